@@ -0,0 +1,272 @@
+// Differential stress test of the row editing primitives
+// Applies random edits to the editor rows and to a plain array of lines
+// holding the same text, and checks that they agree
+//   usage: stress [seed] [operations]
+#define main textMain
+#include "text.c"
+#undef main
+
+// Rows kept in the model before it is trimmed back
+#define STRESS_MAX_ROWS 256
+// Operations between full comparisons
+#define STRESS_CHECK_EVERY 64
+
+/*** model ***/
+struct line {
+  char *s;
+  int len;
+};
+
+struct model {
+  struct line *lines;
+  int numlines;
+};
+
+struct model M;
+
+void modelInsertLine(int at, const char *s, int len) {
+  M.lines = realloc(M.lines, sizeof(struct line) * (M.numlines + 1));
+  memmove(&M.lines[at + 1], &M.lines[at],
+          sizeof(struct line) * (M.numlines - at));
+  M.lines[at].s = malloc(len + 1);
+  memcpy(M.lines[at].s, s, len);
+  M.lines[at].len = len;
+  M.numlines++;
+}
+
+void modelDelLine(int at) {
+  free(M.lines[at].s);
+  memmove(&M.lines[at], &M.lines[at + 1],
+          sizeof(struct line) * (M.numlines - at - 1));
+  M.numlines--;
+}
+
+void modelInsert(int at, int cx, const char *s, int len) {
+  struct line *l = &M.lines[at];
+  l->s = realloc(l->s, l->len + len + 1);
+  memmove(&l->s[cx + len], &l->s[cx], l->len - cx);
+  memcpy(&l->s[cx], s, len);
+  l->len += len;
+}
+
+void modelDelete(int at, int cx, int len) {
+  struct line *l = &M.lines[at];
+  memmove(&l->s[cx], &l->s[cx + len], l->len - cx - len);
+  l->len -= len;
+}
+
+// Screen column after a character, written out without the kernels
+int modelNext(char c, int rx) {
+  if (c == '\t')
+    return (rx / TEXT_TAB_STOP + 1) * TEXT_TAB_STOP;
+  if ((unsigned char)c < 0x20 || c == 0x7f)
+    return rx + 2;
+  return rx + 1;
+}
+
+// Whether 'render' isn't the line with tabs and control bytes expanded
+int modelRenderDiffers(struct line *l, const char *render) {
+  int rx = 0;
+  int j;
+  for (j = 0; j < l->len; j++) {
+    char c = l->s[j];
+    int next = modelNext(c, rx);
+    if (c == '\t') {
+      for (; rx < next; rx++) {
+        if (render[rx] != ' ')
+          return 1;
+      }
+    } else if (next - rx == 2) {
+      if (render[rx] != '^' || render[rx + 1] != (c ^ 0x40))
+        return 1;
+    } else if (render[rx] != c) {
+      return 1;
+    }
+    rx = next;
+  }
+  return render[rx] != '\0';
+}
+
+/*** checks ***/
+unsigned long checks;
+
+void fail(long op, const char *what, int at) {
+  fprintf(stderr, "mismatch after operation %ld: %s (row %d)\n", op, what,
+          at);
+  exit(1);
+}
+
+// Compare every row, its render and column mapping, the byte offsets
+// and the screen lines
+void check(long op) {
+  if (E.numrows != M.numlines)
+    fail(op, "row count", E.numrows);
+  long long offset = 0;
+  int j, cx;
+  for (j = 0; j < E.numrows; j++) {
+    erow *row = &E.row[j];
+    struct line *l = &M.lines[j];
+    if (row->size != l->len || memcmp(row->chars, l->s, l->len) != 0 ||
+        row->chars[row->size] != '\0')
+      fail(op, "characters", j);
+    int rx = 0;
+    for (cx = 0; cx <= l->len; cx++) {
+      if (editorRowCxToRx(row, cx) != rx)
+        fail(op, "cx to rx", j);
+      if (cx < l->len) {
+        int next = modelNext(l->s[cx], rx);
+        if (editorRowRxtoCx(row, next - 1) != cx)
+          fail(op, "rx to cx", j);
+        rx = next;
+      }
+    }
+    char *render = editorRowRender(row);
+    if (row->rsize != rx || modelRenderDiffers(l, render))
+      fail(op, "render", j);
+    if (editorByteOffset(j, 0) != offset ||
+        fenwickSearch(editorOffsets(), offset) != j)
+      fail(op, "byte offset", j);
+    offset += l->len + 1;
+    // soft wrap screen lines, through the rows shifted since the build
+    struct fenwick *f = editorVlines();
+    if (fenwickPrefix(f, j + 1) - fenwickPrefix(f, j) !=
+            wrapRow(row, E.screencols, NULL) ||
+        fenwickSearch(f, fenwickPrefix(f, j)) != j)
+      fail(op, "screen lines", j);
+  }
+  checks++;
+}
+
+/*** operations ***/
+// Random text with tabs, control bytes and UTF-8 lead bytes mixed in
+int randomText(char *s, int max) {
+  static const char alphabet[] = "abc xyz\t\x01\x7f\xc3";
+  int len = rand() % (max + 1);
+  int j;
+  for (j = 0; j < len; j++) {
+    s[j] = alphabet[rand() % (sizeof(alphabet) - 1)];
+  }
+  return len;
+}
+
+// A random cursor position, on the line past the text too
+void randomCursor() {
+  E.cy = rand() % (E.numrows + 1);
+  E.cx = E.cy < E.numrows ? rand() % (E.row[E.cy].size + 1) : 0;
+}
+
+// Apply one random edit to both the rows and the model
+void step(long op) {
+  char s[16];
+  int len = randomText(s, sizeof(s));
+  int at, cx, cy;
+  switch (rand() % 7) {
+  case 0: // out of range rows are ignored
+    at = rand() % (E.numrows + 3) - 1;
+    editorInsertRow(at, s, len);
+    if (at >= 0 && at <= M.numlines)
+      modelInsertLine(at, s, len);
+    break;
+  case 1:
+    at = rand() % (E.numrows + 3) - 1;
+    editorDelRow(at);
+    if (at >= 0 && at < M.numlines)
+      modelDelLine(at);
+    break;
+  case 2: // out of range columns append
+    if (E.numrows == 0)
+      break;
+    at = rand() % E.numrows;
+    cx = rand() % (E.row[at].size + 3) - 1;
+    s[0] = len ? s[0] : 'q';
+    editorRowInsertChar(&E.row[at], cx, s[0]);
+    if (cx < 0 || cx > M.lines[at].len)
+      cx = M.lines[at].len;
+    modelInsert(at, cx, s, 1);
+    break;
+  case 3: // out of range columns are ignored
+    if (E.numrows == 0)
+      break;
+    at = rand() % E.numrows;
+    cx = rand() % (E.row[at].size + 3) - 1;
+    editorRowDelChar(&E.row[at], cx);
+    if (cx >= 0 && cx < M.lines[at].len)
+      modelDelete(at, cx, 1);
+    break;
+  case 4:
+    randomCursor();
+    cy = E.cy;
+    cx = E.cx;
+    editorInsertNewLine();
+    if (cx == 0) {
+      modelInsertLine(cy, "", 0);
+    } else {
+      modelInsertLine(cy + 1, &M.lines[cy].s[cx], M.lines[cy].len - cx);
+      M.lines[cy].len = cx;
+    }
+    if (E.cy != cy + 1 || E.cx != 0)
+      fail(op, "cursor after newline", cy);
+    break;
+  case 5:
+    randomCursor();
+    cy = E.cy;
+    cx = E.cx;
+    editorDelChar();
+    if (cy == M.numlines || (cx == 0 && cy == 0)) {
+      if (E.cy != cy || E.cx != cx)
+        fail(op, "cursor after nothing to delete", cy);
+    } else if (cx > 0) {
+      modelDelete(cy, cx - 1, 1);
+      if (E.cy != cy || E.cx != cx - 1)
+        fail(op, "cursor after delete", cy);
+    } else {
+      int prev = M.lines[cy - 1].len;
+      modelInsert(cy - 1, prev, M.lines[cy].s, M.lines[cy].len);
+      modelDelLine(cy);
+      if (E.cy != cy - 1 || E.cx != prev)
+        fail(op, "cursor after join", cy);
+    }
+    break;
+  case 6:
+    randomCursor();
+    cy = E.cy;
+    cx = E.cx;
+    s[0] = len ? s[0] : 'q';
+    editorInsertChar(s[0]);
+    if (cy == M.numlines)
+      modelInsertLine(cy, "", 0);
+    modelInsert(cy, cx, s, 1);
+    break;
+  }
+  // keeping the rows few so that checks stay cheap
+  while (M.numlines > STRESS_MAX_ROWS) {
+    editorDelRow(0);
+    modelDelLine(0);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  unsigned seed = argc > 1 ? strtoul(argv[1], NULL, 10) : 1;
+  long ops = argc > 2 ? strtol(argv[2], NULL, 10) : 200000;
+  srand(seed);
+  // the parts of initEditor() that don't need a terminal
+  E.screenrows = 24;
+  E.screencols = 80;
+  E.budget = TEXT_RENDER_BUDGET;
+
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  long op;
+  for (op = 1; op <= ops; op++) {
+    step(op);
+    if (op % STRESS_CHECK_EVERY == 0)
+      check(op);
+  }
+  check(ops);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+
+  double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+  printf("seed %u: %ld operations, %lu checks in %.2fs (%.0f ops/s)\n", seed,
+         ops, checks, secs, ops / secs);
+  return 0;
+}
@@ -6,12 +6,19 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
@@ -20,6 +27,30 @@
 #define TEXT_VERSION "0.0.1"
 #define TEXT_TAB_STOP 8
 #define TEXT_QUIT_TIMES 3
+// Size of the staging buffer the background save writes through
+#define TEXT_SAVE_CHUNK (1 << 20)
+// Bytes of a file that may move for a save to still patch it in place
+#define TEXT_PATCH_TAIL (1 << 20)
+// DFA states a compiled regex caches before starting over (power of 2)
+#define TEXT_DFA_MAX_STATES 1024
+// Compiled search patterns kept around
+#define TEXT_REGEX_CACHE 8
+// Bulk changes Ctrl-Z can revert
+#define TEXT_UNDO_LEVELS 16
+// Upper bound of worker threads for bulk operations
+#define TEXT_MAX_THREADS 16
+// Buffers smaller than this are processed without extra threads
+#define TEXT_PARALLEL_MIN_ROWS 4096
+// Default bytes of render buffers kept for rows off screen
+#define TEXT_RENDER_BUDGET (16 << 20)
+// Milliseconds without resize signals that end a burst of them
+#define TEXT_RESIZE_SETTLE 30
+// Milliseconds of loading between checks for key presses
+#define TEXT_LOAD_SLICE 10
+// Bytes read from the file at a time while loading
+#define TEXT_LOAD_CHUNK (1 << 16)
+// Single row inserts and deletes a row index notes before a rebuild
+#define TEXT_INDEX_SHIFTS 64
 // All Ctrl + k operations results in 0x[ASCII_CODE_IN_HEX] & 0x1f
 // Ctrl + Q = 0x17 => 0b01110001 & 0b00011111 = 0b00010001 = 0x17
 #define CTRL_KEY(k) ((k)&0x1f)
@@ -38,14 +69,153 @@ enum editorKey {
 };
 
 /*** data ***/
+// Reference counted storage for the characters of a row, the characters
+// follow the header in the same allocation. A row shares its block with
+// the undo history or the clipboard instead of copying it, and copies it
+// before writing to it if someone else still holds a reference
+// (copy-on-write). A save in progress reads the blocks older than it
+// without holding references, so those are copied too
+typedef struct tblock {
+  int refs;  // Number of rows pointing at this block
+  int epoch; // E.epoch when it was allocated
+} tblock;
+
 // Editor Row - Store the Line of Text
 typedef struct erow {
   int size;     // Size of Line
   int rsize;    // size of content of render
   char *chars;  // Pointer to Character Data of Line
-  char *render; // contains string for Characters to draw on screen
+  char *render; // Expanded 'chars' to draw, NULL until needed
+  tblock *blk;  // Block that owns 'chars'
+  int dsize;    // size of the line in the file on disk, -1 if not there,
+                // only kept once changed since the last save
+  int epoch;    // E.epoch of the last change, dirty while above E.clean
+  int nwrap;    // screen lines in soft wrap mode, 0 until computed
+  int *wrap;    // render offsets of the screen lines after the first
 } erow;
 
+// Compression format files are streamed through, by running its command
+// line tool as a filter between the file and the editor
+struct codec {
+  const char *name;
+  const char *magic; // bytes the compressed files start with
+  int magiclen;
+  char *const *decompress; // argv reading stdin, writing stdout
+  char *const *compress;
+};
+
+// A save running on a writer thread. 'rows' is a snapshot of E.row taken
+// when the save started, every row in it holds a reference on its block
+// so editing can go on while the snapshot is written out
+struct editorSaveJob {
+  pthread_t thread;
+  int threaded; // 'thread' still has to be joined
+  char *filename;
+  char *tmpname; // new file renamed over 'filename' when not patching
+  const struct codec *codec; // format to compress to, NULL for plain text
+  erow *rows;       // E.row itself until the editor changes it
+  int numrows;
+  tblock **freed;   // blocks of the snapshot dropped by the editor
+  int numfreed;
+  int dirty;        // E.dirty when the snapshot was taken
+  int since;        // rows with a higher epoch differ from the file
+  int clean;        // E.clean once saved
+  int patch;        // write only the dirty rows and the tail in place
+  int inplace;      // truncate and rewrite the file instead of renaming
+  int stable;       // rows in front of this one didn't move in the file
+  mode_t mode;      // permissions of a new file
+  long long size;   // size of the file once saved
+  long long total;  // bytes to write
+  int percent;      // last progress shown in the message bar
+  pthread_mutex_t lock;
+  long long written; // bytes written so far (guarded by lock)
+  int done;          // writer finished (guarded by lock)
+  int err;           // errno of the failed call, 0 on success
+  struct stat st;    // the saved file (set on success)
+};
+
+// What the file on disk looked like when last read or written
+struct editorDisk {
+  int valid; // the rows mirror the file, which can be patched
+  int numrows;
+  long long size;
+  ino_t ino;
+  struct timespec mtime;
+};
+
+// One contiguous piece of a bulk change: it left 'newcount' rows at 'at'
+// in place of the 'oldcount' rows starting at editorUndo.rows[first]
+struct undoPiece {
+  int at;
+  int oldcount;
+  int newcount;
+  int first;
+};
+
+// A bulk change to E.row that Ctrl-Z can revert. The replaced rows are
+// kept with a reference on their blocks, without their render
+struct editorUndo {
+  struct undoPiece *pieces; // applied in order, reverted in reverse order
+  int numpieces, cappieces;
+  erow *rows;
+  int numrows, caprows;
+  long long before; // E.changes before the change
+  long long after;  // E.changes right after it, the change is only
+                    // revertible while no other edit happened
+  int cx, cy;       // cursor before the change
+};
+
+// A slice of rows handed to a worker thread
+struct rowChunk {
+  pthread_t thread;
+  int from, to;    // rows [from, to)
+  void *job;       // description shared by all chunks
+  erow *rows;      // rows produced by the chunk
+  int *index;      // row index each produced row belongs to
+  int numrows;
+  long long count; // chunk specific tally
+};
+
+// A row inserted ('count' 1) or deleted ('count' -1) at 'at' after a
+// fenwick tree was built, 'value' is the value of that row
+struct fenwickShift {
+  int at;
+  int count;
+  long long value;
+};
+
+// Fenwick tree (binary indexed tree) of a value per row
+struct fenwick {
+  long long *tree; // 1-based, tree[i] sums the values of rows (i - i&-i, i]
+  int n;
+  int cap;   // entries allocated in tree
+  int valid; // 0 when it has to be rebuilt before use
+  // rows inserted and deleted since it was built, oldest first
+  struct fenwickShift shifts[TEXT_INDEX_SHIFTS];
+  int nshifts;
+};
+
+// File being read into E.row a slice at a time between key presses
+struct editorLoad {
+  int fd;          // -1 when nothing is loading
+  pid_t pid;       // decompressor feeding 'fd', -1 if none
+  char *buf;       // bytes read but not split into rows yet
+  size_t len, cap;
+  int rowcap;      // rows allocated in E.row
+  long long bytes; // read so far
+  long long total; // size of the file, -1 if unknown (pipes, codecs)
+  struct stat st;
+  int exact; // every line ended in a single '\n' so far
+};
+
+// Last frame sent to the terminal, a refresh only sends what changed
+struct editorFrame {
+  char *text;       // the lines back to back
+  int *start;       // offset of each line in text, numlines + 1 entries
+  int numlines;     // screen rows + status bar + message bar, 0 if no frame
+  long long rowoff; // top line (E.rowoff, or E.voff when wrapping)
+};
+
 struct editorConfig {
   int cx, cy;
   int rx;
@@ -55,10 +225,38 @@ struct editorConfig {
   int screencols;
   int numrows;
   erow *row; // Array of erow where each erow stores a line read from a file
+  struct fenwick offsets; // row sizes + newline, gives byte offsets
+  int wrap;               // soft wrap long rows instead of scrolling sideways
+  struct fenwick vlines;  // screen lines of each row in soft wrap mode
+  int wrapcols;           // screencols the rows were wrapped for
+  long long voff;         // soft wrap - screen line at the top
+  int wraprowoff;         // soft wrap - E.rowoff that 'voff' was set for
   int dirty;
+  long long changes; // edits made so far, unlike 'dirty' never reset
+  struct editorUndo *undo[TEXT_UNDO_LEVELS]; // bulk changes, newest last
+  int numundo;
+  struct editorSaveJob *save; // save in progress, NULL if none
+  int markset;        // the selection runs from the mark to the cursor
+  int markx, marky;   // position of the mark
+  int block;          // the mark is the corner of a rectangle, markx is
+                      // then a render column
+  int blockx;         // render column of the block corner at the cursor,
+                      // kept while the cursor passes shorter rows
+  erow *clip;         // clipboard lines, slices sharing the rows' blocks
+  int numclip;
+  struct editorDisk disk;
+  struct editorLoad load;
+  int epoch;    // stamped on changed rows, bumped by each save
+  int clean;    // epoch up to which changes are on disk
+  int shiftrow; // first row that may have moved in the file since a save
   char *filename;
+  const struct codec *codec; // compression of the file, NULL if none
   char statusmsg[80];
   time_t statusmsg_time;
+  struct editorFrame frame;
+  long long renderbytes; // held in the render buffers of the rows
+  long long budget;      // renderbytes allowed before evicting
+  long long renderkept;  // renderbytes left by the last eviction
   struct termios orig_termios;
 };
 
@@ -67,7 +265,12 @@ struct editorConfig E;
 /*** prototype ***/
 void editorSetStatusMessage(const char *fmt, ...);
 void editorRefreshScreen();
-char *editorPrompt(char *prompt, void (*callback)(char *, int));
+char *editorPrompt(char *prompt, void (*callback)(char *, int),
+                   int allowempty);
+int editorPollSave();
+int getWindowSize(int *rows, int *cols);
+void editorLoadMore(int ms);
+char *formatBytes(char *buf, size_t bufsize, long long n);
 
 /*** terminal ***/
 // To Handle Errors
@@ -83,7 +286,7 @@ void die(const char *s) {
 // To Disable Raw Mode during Exit
 void disableRawMode() {
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1) {
-    die("tcgetattr");
+    die("tcsetattr");
   }
 }
 
@@ -91,7 +294,7 @@ void disableRawMode() {
 void enableRawMode() {
   // get the current attributes of terminal in struct 'orig_termios'
   if (tcgetattr(STDIN_FILENO, &E.orig_termios)) {
-    die("tcsetattr");
+    die("tcgetattr");
   }
 
   // restoring original terminal atrributes on quit
@@ -110,7 +313,7 @@ void enableRawMode() {
   raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
   raw.c_iflag &= ~(ICRNL | IXON);
   raw.c_oflag &= ~(OPOST);
-  raw.c_lflag |= (CS8);
+  raw.c_cflag |= (CS8);
   raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
 
   // read timeout
@@ -119,17 +322,93 @@ void enableRawMode() {
   raw.c_cc[VTIME] = 1;
 
   // setting the modified attributes to terminal
-  tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+  if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) {
+    die("tcsetattr");
+  }
+}
+
+// Self-pipe the SIGWINCH handler writes to, so that resizes reach the
+// input loop instead of interrupting whatever runs
+int winch_pipe[2] = {-1, -1};
+
+void editorHandleWinch(int sig) {
+  (void)sig;
+  int saved = errno;
+  // a full pipe already has a resize pending
+  if (write(winch_pipe[1], "", 1) == -1) {
+  }
+  errno = saved;
+}
+
+// Take the new size of the terminal. Only the state depending on it is
+// reset: the wrap points follow screencols, the scroll offsets are fixed
+// up by the next refresh
+int editorResize() {
+  int rows, cols;
+  if (getWindowSize(&rows, &cols) == -1)
+    return 0;
+  rows -= 2;
+  if (rows < 1)
+    rows = 1;
+  if (rows == E.screenrows && cols == E.screencols)
+    return 0;
+  E.screenrows = rows;
+  E.screencols = cols;
+  // the terminal reflowed what it showed
+  E.frame.numlines = 0;
+  // the screen lines are counted anew, the view keeps its top row
+  E.wraprowoff = -1;
+  return 1;
+}
+
+// Consume the pending resize signals, waiting for a burst of them (like
+// dragging the window edge) to end so it is laid out only once
+void editorDrainWinch() {
+  struct pollfd p = {winch_pipe[0], POLLIN, 0};
+  char buf[64];
+  int n;
+  do {
+    while (read(winch_pipe[0], buf, sizeof(buf)) > 0) {
+    }
+    n = poll(&p, 1, TEXT_RESIZE_SETTLE);
+  } while (n > 0 || (n == -1 && errno == EINTR));
 }
 
 // Wait for an Key Press
 int editorReadKey() {
   int nread;
   char c;
-  // failing C Library function sets errno to some value to indicate failure
-  while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-    if (nread == -1 && errno != EAGAIN)
-      die("read");
+  while (1) {
+    // a file still loading is read whenever no key is waiting
+    struct pollfd fds[3] = {{STDIN_FILENO, POLLIN, 0},
+                            {winch_pipe[0], POLLIN, 0},
+                            {E.load.fd, POLLIN, 0}};
+    int ready = poll(fds, 3, 100);
+    if (ready == -1 && errno != EINTR)
+      die("poll");
+    if (ready > 0 && fds[1].revents) {
+      editorDrainWinch();
+      if (editorResize())
+        editorRefreshScreen();
+      continue;
+    }
+    if (ready > 0 && fds[0].revents) {
+      // failing C Library function sets errno to some value to indicate
+      // failure
+      nread = read(STDIN_FILENO, &c, 1);
+      if (nread == 1)
+        break;
+      if (nread == -1 && errno != EAGAIN && errno != EINTR)
+        die("read");
+    }
+    if (ready > 0 && fds[2].revents) {
+      editorLoadMore(TEXT_LOAD_SLICE);
+      editorRefreshScreen();
+      continue;
+    }
+    // no key within the timeout - report background save progress
+    if (editorPollSave())
+      editorRefreshScreen();
   }
   // If we read an escape chracter we *immediately*
   // read the next two letters after it and remap them to WASD
@@ -208,7 +487,7 @@ int getCursorPosition(int *rows, int *cols) {
   while (i < sizeof(buf) - 1) {
     if (read(STDIN_FILENO, &buf[i], 1) != 1)
       break;
-    if (buf[1] == 'R')
+    if (buf[i] == 'R')
       break;
     i++;
   }
@@ -253,33 +532,415 @@ int getWindowSize(int *rows, int *cols) {
   }
 }
 
+/*** row storage ***/
+// Allocate a block with room for 'len' characters and the NULL
+tblock *blockNew(size_t len) {
+  tblock *blk = malloc(sizeof(tblock) + len + 1);
+  if (blk == NULL)
+    die("malloc");
+  blk->refs = 1;
+  blk->epoch = E.epoch;
+  return blk;
+}
+
+// Characters stored in a block
+char *blockData(tblock *blk) { return (char *)(blk + 1); }
+
+void blockRef(tblock *blk) { blk->refs++; }
+
+// Whether the save in progress may still read the block
+int blockSaving(tblock *blk) {
+  return E.save && blk->epoch <= E.save->clean;
+}
+
+// Drop a reference, freeing the block with the last one. The save in
+// progress frees it once written if it may still read it
+void blockUnref(tblock *blk) {
+  if (--blk->refs > 0)
+    return;
+  struct editorSaveJob *job = E.save;
+  if (blockSaving(blk)) {
+    // growing the list at powers of 2
+    if ((job->numfreed & (job->numfreed - 1)) == 0)
+      job->freed = realloc(job->freed, sizeof(tblock *) *
+                                           (job->numfreed ? job->numfreed * 2
+                                                          : 16));
+    job->freed[job->numfreed++] = blk;
+  } else {
+    free(blk);
+  }
+}
+
+// Make E.row writable. The save in progress writes out the array E.row
+// had when it started, the first change to it copies the descriptors
+void editorRowsOwn() {
+  struct editorSaveJob *job = E.save;
+  if (job == NULL || E.row != job->rows)
+    return;
+  E.row = malloc(sizeof(erow) * (E.numrows ? E.numrows : 1));
+  if (E.numrows)
+    memcpy(E.row, job->rows, sizeof(erow) * E.numrows);
+}
+
+// Size of the line at the position of the row in the file on disk, the
+// rows unchanged since the last save are the line
+int editorRowDiskSize(erow *row) {
+  return row->epoch < E.epoch ? row->size : row->dsize;
+}
+
+// Make row->chars writable with room for 'cap' characters (cap >= size),
+// returns where the row is now that E.row is writable.
+// If the block is shared with the undo history or the clipboard, is read
+// by a save, or the row is only a slice of it, the row gets its own copy
+erow *editorRowReserve(erow *row, int cap) {
+  struct editorSaveJob *job = E.save;
+  editorRowsOwn();
+  if (job && row >= job->rows && row < job->rows + job->numrows)
+    row = &E.row[row - job->rows];
+  // the line on disk, before the first change since the save
+  row->dsize = editorRowDiskSize(row);
+  if (row->blk->refs > 1 || row->chars != blockData(row->blk) ||
+      blockSaving(row->blk)) {
+    tblock *blk = blockNew(cap);
+    memcpy(blockData(blk), row->chars, row->size);
+    blockData(blk)[row->size] = '\0';
+    blockUnref(row->blk);
+    row->blk = blk;
+  } else {
+    row->blk = realloc(row->blk, sizeof(tblock) + cap + 1);
+    if (row->blk == NULL)
+      die("realloc");
+  }
+  row->chars = blockData(row->blk);
+  return row;
+}
+
+/*** render kernels ***/
+// Tabs and control bytes are the only characters that don't take a single
+// screen column, these helpers are specialized for TEXT_TAB_STOP when built
+#if TEXT_TAB_STOP < 1
+#error "TEXT_TAB_STOP must be positive"
+#endif
+
+// Screen column after a tab drawn at column 'rx', a mask when the tab
+// stop is a power of 2
+#if (TEXT_TAB_STOP & (TEXT_TAB_STOP - 1)) == 0
+#define TAB_NEXT(rx) (((rx) | (TEXT_TAB_STOP - 1)) + 1)
+#else
+#define TAB_NEXT(rx) ((rx) + TEXT_TAB_STOP - (rx) % TEXT_TAB_STOP)
+#endif
+
+// Control bytes (tab included) and DEL, drawn as ^X in two columns
+#define RENDER_SPECIAL(c) ((unsigned char)(c) < 0x20 || (c) == 0x7f)
+
+// A byte repeated in every byte of a word
+#define WORD_BYTES(b) ((unsigned long)-1 / 0xff * (b))
+
+// Number of characters of 's' before the first tab or control byte.
+// Checks a word at a time, only the word that has one is looked at byte
+// by byte
+int renderScan(const char *s, int len) {
+  int i = 0;
+  for (; i + (int)sizeof(unsigned long) <= len; i += sizeof(unsigned long)) {
+    unsigned long w;
+    memcpy(&w, &s[i], sizeof(w));
+    unsigned long del = w ^ WORD_BYTES(0x7f);
+    // high bit of the bytes below 0x20 or equal to 0x7f
+    if ((((w - WORD_BYTES(0x20)) & ~w) | ((del - WORD_BYTES(1)) & ~del)) &
+        WORD_BYTES(0x80))
+      break;
+  }
+  while (i < len && !RENDER_SPECIAL(s[i]))
+    i++;
+  return i;
+}
+
+// Screen column after drawing 'c' at column 'rx'
+int renderNext(char c, int rx) {
+  if (c == '\t')
+    return TAB_NEXT(rx);
+  return RENDER_SPECIAL(c) ? rx + 2 : rx + 1;
+}
+
+/*** row index ***/
+// Fenwick tree over one value per row: prefix sums, point updates and
+// searching for the row at a running total all take O(log n)
+void fenwickBuild(struct fenwick *f, int n, long long (*value)(int)) {
+  f->tree = realloc(f->tree, sizeof(long long) * (n + 1));
+  f->n = n;
+  f->cap = n + 1;
+  int i;
+  for (i = 1; i <= n; i++) {
+    f->tree[i] = value(i - 1);
+  }
+  // folding every node into its parent, O(n)
+  for (i = 1; i <= n; i++) {
+    int parent = i + (i & -i);
+    if (parent <= n)
+      f->tree[parent] += f->tree[i];
+  }
+  f->valid = 1;
+  f->nshifts = 0;
+}
+
+// Sum of the values of the first 'i' rows
+long long fenwickPrefix(struct fenwick *f, int i) {
+  long long sum = 0;
+  // rows inserted and deleted since the build, newest first: the rows
+  // after them were one row further up, or down, in the tree
+  int k;
+  for (k = f->nshifts - 1; k >= 0; k--) {
+    struct fenwickShift *s = &f->shifts[k];
+    if (i <= s->at)
+      continue;
+    i -= s->count;
+    sum += s->count * s->value;
+  }
+  for (; i > 0; i -= i & -i) {
+    sum += f->tree[i];
+  }
+  return sum;
+}
+
+// Add 'delta' to the value of row 'i'
+void fenwickAdd(struct fenwick *f, int i, long long delta) {
+  int k;
+  for (k = f->nshifts - 1; k >= 0; k--) {
+    struct fenwickShift *s = &f->shifts[k];
+    if (s->count > 0 && i == s->at) {
+      // a row inserted since the build isn't in the tree
+      s->value += delta;
+      return;
+    }
+    if (i >= s->at + (s->count > 0))
+      i -= s->count;
+  }
+  for (i++; i <= f->n; i += i & -i) {
+    f->tree[i] += delta;
+  }
+}
+
+// Insert a row with 'value' at 'at' (count 1) or delete the row at 'at'
+// (count -1) in O(1) by noting it, the queries account for the noted rows
+// and the tree is marked for a rebuild once too many are
+void fenwickShift(struct fenwick *f, int at, int count, long long value) {
+  if (f->nshifts == TEXT_INDEX_SHIFTS) {
+    f->valid = 0;
+    return;
+  }
+  if (count < 0)
+    value = fenwickPrefix(f, at + 1) - fenwickPrefix(f, at);
+  struct fenwickShift *s = &f->shifts[f->nshifts++];
+  s->at = at;
+  s->count = count;
+  s->value = value;
+}
+
+// Add a row with 'value' after the last one
+void fenwickAppend(struct fenwick *f, long long value) {
+  if (f->nshifts) {
+    f->valid = 0;
+    return;
+  }
+  int i = ++f->n;
+  if (i >= f->cap) {
+    f->cap = f->cap ? f->cap * 2 : 64;
+    f->tree = realloc(f->tree, sizeof(long long) * f->cap);
+  }
+  // the node covers the new row and the nodes right below it
+  f->tree[i] = value;
+  int j;
+  for (j = 1; j < (i & -i); j *= 2) {
+    f->tree[i] += f->tree[i - j];
+  }
+}
+
+// Number of leading rows whose values add up to at most 'sum', that is
+// the row the running total 'sum' falls in
+int fenwickSearch(struct fenwick *f, long long sum) {
+  if (f->nshifts) {
+    // rows moved since the build - binary search over the prefix sums,
+    // O(log n) queries that each account for the shifts
+    int lo = 0, hi = f->n;
+    int k;
+    for (k = 0; k < f->nshifts; k++) {
+      hi += f->shifts[k].count;
+    }
+    while (lo < hi) {
+      int mid = lo + (hi - lo + 1) / 2;
+      if (fenwickPrefix(f, mid) <= sum)
+        lo = mid;
+      else
+        hi = mid - 1;
+    }
+    return lo;
+  }
+  int pos = 0;
+  int step = 1;
+  while (step * 2 <= f->n) {
+    step *= 2;
+  }
+  for (; step > 0; step /= 2) {
+    if (pos + step <= f->n && f->tree[pos + step] <= sum) {
+      pos += step;
+      sum -= f->tree[pos];
+    }
+  }
+  return pos;
+}
+
+// Bytes a row takes in the file, with its newline
+long long editorRowBytes(int at) { return E.row[at].size + 1; }
+
+// Byte offset index of the rows, rebuilt if rows were added or removed
+// in bulk
+struct fenwick *editorOffsets() {
+  if (!E.offsets.valid)
+    fenwickBuild(&E.offsets, E.numrows, editorRowBytes);
+  return &E.offsets;
+}
+
+// Rows were inserted, deleted or replaced wholesale, the ones from 'at'
+// on may have moved in the file
+void editorRowsChanged(int at) {
+  E.offsets.valid = 0;
+  E.vlines.valid = 0;
+  if (at < E.shiftrow)
+    E.shiftrow = at;
+}
+
+// Screen lines of a row wrapped at 'cols' columns. A line that doesn't
+// fit breaks after its last blank, or at the edge if it has none. Fills
+// 'wrap', when given, with the render offsets the other lines start at
+int wrapRow(erow *row, int cols, int *wrap) {
+  // most rows fit the screen
+  if (row->size <= cols && renderScan(row->chars, row->size) == row->size)
+    return 1;
+  int lines = 1;
+  int linestart = 0; // render offset of the current line
+  int blank = -1;    // render offset after the last blank seen
+  int rx = 0;
+  int j;
+  for (j = 0; j < row->size; j++) {
+    char c = row->chars[j];
+    int width = renderNext(c, rx) - rx;
+    while (width--) {
+      if (rx - linestart == cols) {
+        linestart = blank > linestart ? blank : rx;
+        if (wrap)
+          wrap[lines - 1] = linestart;
+        lines++;
+      }
+      rx++;
+      if (c == ' ' || c == '\t')
+        blank = rx;
+    }
+  }
+  return lines;
+}
+
+// Forget the wrap points of a row
+void editorDropWrap(erow *row) {
+  free(row->wrap);
+  row->wrap = NULL;
+  row->nwrap = 0;
+}
+
+// Screen lines of a row in soft wrap mode, wrapping it if needed
+int editorRowWrap(erow *row) {
+  if (row->nwrap == 0) {
+    row->nwrap = wrapRow(row, E.screencols, NULL);
+    if (row->nwrap > 1) {
+      row->wrap = malloc(sizeof(int) * (row->nwrap - 1));
+      wrapRow(row, E.screencols, row->wrap);
+    }
+  }
+  return row->nwrap;
+}
+
+long long editorRowVlines(int at) { return editorRowWrap(&E.row[at]); }
+
+// Screen line index of the rows in soft wrap mode, rewrapping them all
+// if the screen width changed
+struct fenwick *editorVlines() {
+  if (E.wrapcols != E.screencols) {
+    int j;
+    for (j = 0; j < E.numrows; j++) {
+      editorDropWrap(&E.row[j]);
+    }
+    E.wrapcols = E.screencols;
+    E.vlines.valid = 0;
+  }
+  if (!E.vlines.valid)
+    fenwickBuild(&E.vlines, E.numrows, editorRowVlines);
+  return &E.vlines;
+}
+
+// A single row was inserted at 'at' (count 1) or is about to be deleted
+// from there (count -1). The byte offsets and screen lines note it rather
+// than being rebuilt, so that Enter on a large file doesn't cost O(n)
+void editorRowShifted(int at, int count) {
+  if (E.offsets.valid)
+    fenwickShift(&E.offsets, at, count, E.row[at].size + 1);
+  if (E.vlines.valid)
+    fenwickShift(&E.vlines, at, count,
+                 count > 0 ? editorRowWrap(&E.row[at]) : 0);
+  if (at < E.shiftrow)
+    E.shiftrow = at;
+}
+
+// The characters of a single row changed
+void editorRowChanged(erow *row) {
+  row->epoch = E.epoch;
+  int at = row - E.row;
+  if (E.vlines.valid) {
+    long long old = fenwickPrefix(&E.vlines, at + 1) -
+                    fenwickPrefix(&E.vlines, at);
+    fenwickAdd(&E.vlines, at, editorRowWrap(row) - old);
+  }
+  if (!E.offsets.valid)
+    return;
+  long long old = fenwickPrefix(&E.offsets, at + 1) -
+                  fenwickPrefix(&E.offsets, at);
+  fenwickAdd(&E.offsets, at, row->size + 1 - old);
+}
+
+// Byte offset of a position in the file
+long long editorByteOffset(int cy, int cx) {
+  return fenwickPrefix(editorOffsets(), cy) + cx;
+}
+
 /*** row operations ***/
+// Count an edit of the buffer
+void editorMarkDirty() {
+  E.dirty++;
+  E.changes++;
+}
+
 // For moving tabs - Converts a e.chars index into a e.render index
 int editorRowCxToRx(erow *row, int cx) {
-  int rx = 0;
+  // the characters before the first tab or control byte are one column
+  int rx = renderScan(row->chars, cx);
   int j;
-  for (j = 0; j < cx; j++) {
-    if (row->chars[j] == '\t') {
-      rx *= (TEXT_TAB_STOP - 1) - (rx % TEXT_TAB_STOP);
-    }
-    rx++;
+  for (j = rx; j < cx; j++) {
+    rx = renderNext(row->chars[j], rx);
   }
   return rx;
 }
 
 // Convertes the e.render index into e.chars index
 int editorRowRxtoCx(erow *row, int rx) {
+  // no tab or control byte before 'rx' - the index is the column
+  int plain = rx < row->size ? rx : row->size;
+  int cx = renderScan(row->chars, plain);
+  if (cx == plain)
+    return cx;
   // Current Render Index
-  int cur_rx = 0;
-  // Loop through the chars string
+  int cur_rx = cx;
+  // Loop through the rest of the chars string
   // while maintaining curr_rx till we reach 'rx'
-  int cx;
-  for (cx = 0; cx < row->size; cx++) {
-    // increment curr_rx accordingly on finding that a character is TAB
-    if (row->chars[cx] == '\t') {
-      cur_rx += (TEXT_TAB_STOP - 1) - (cur_rx % TEXT_TAB_STOP);
-    }
-    cur_rx++;
+  for (; cx < row->size; cx++) {
+    cur_rx = renderNext(row->chars[cx], cur_rx);
 
     if (cur_rx > rx) {
       return cx;
@@ -288,37 +949,99 @@ int editorRowRxtoCx(erow *row, int rx) {
   return cx;
 }
 
-// For Rendering Special Characters
-void editorUpdateRow(erow *row) {
-  // Counting the number of tabs in the row
-  int tabs = 0;
+// Bytes needed to render a row, with the terminator
+int editorRenderCap(erow *row) {
+  int cap = row->size + 1;
+  // tabs take up to a tab stop, control bytes take two
   int j;
-  for (j = 0; j < row->size; j++) {
+  for (j = renderScan(row->chars, row->size); j < row->size; j++) {
     if (row->chars[j] == '\t')
-      tabs++;
+      cap += TEXT_TAB_STOP - 1;
+    else if (RENDER_SPECIAL(row->chars[j]))
+      cap++;
   }
+  return cap;
+}
 
-  free(row->render);
-  row->render = malloc(row->size + tabs * (TEXT_TAB_STOP - 1) + 1);
-
-  // Copying all the characters from row->chars to row->render
+// For Rendering Special Characters - expands 'row' into 'render', which
+// has editorRenderCap() bytes, and returns the length
+int editorRenderInto(erow *row, char *render) {
   int idx = 0;
-  for (j = 0; j < row->size; j++) {
-    if (row->chars[j] == '\t') {
-      row->render[idx++] = ' ';
-      while (idx % TEXT_TAB_STOP != 0) {
-        row->render[idx++] = ' ';
-      }
+  int j = 0;
+  while (j < row->size) {
+    // Copying the characters up to the next tab or control byte at once
+    int run = renderScan(&row->chars[j], row->size - j);
+    memcpy(&render[idx], &row->chars[j], run);
+    idx += run;
+    j += run;
+    if (j == row->size)
+      break;
+    char c = row->chars[j++];
+    if (c == '\t') {
+      int next = TAB_NEXT(idx);
+      memset(&render[idx], ' ', next - idx);
+      idx = next;
     } else {
-      row->render[idx++] = row->chars[j];
+      // ^A for 0x01, ^? for DEL
+      render[idx++] = '^';
+      render[idx++] = c ^ 0x40;
     }
   }
-  row->render[idx] = '\0';
-  row->rsize = idx;
+  render[idx] = '\0';
+  return idx;
+}
+
+// Free the render of a row, it is rebuilt when drawn again
+void editorDropRender(erow *row) {
+  if (row->render == NULL)
+    return;
+  E.renderbytes -= row->rsize + 1;
+  free(row->render);
+  row->render = NULL;
+  row->rsize = 0;
+}
+
+// The chars of a row changed, its render and wrap points are stale
+void editorUpdateRow(erow *row) {
+  editorDropRender(row);
+  editorDropWrap(row);
+}
+
+// Render of a row, built on first use
+char *editorRowRender(erow *row) {
+  if (row->render == NULL) {
+    row->render = malloc(editorRenderCap(row));
+    row->rsize = editorRenderInto(row, row->render);
+    E.renderbytes += row->rsize + 1;
+  }
+  return row->render;
+}
+
+// Keep the render buffers within the budget by dropping those of the
+// rows away from the screen. Only runs once the cache doubled since the
+// last time, so that a budget smaller than the screen doesn't make every
+// refresh walk all rows
+void editorEvictRenders() {
+  if (E.renderbytes <= E.budget || E.renderbytes <= 2 * E.renderkept)
+    return;
+  // one screen above and below stay for scrolling
+  int from = E.rowoff - E.screenrows;
+  int to = E.rowoff + 2 * E.screenrows;
+  int j;
+  for (j = 0; j < E.numrows; j++) {
+    if (j < from || j >= to)
+      editorDropRender(&E.row[j]);
+  }
+  E.renderkept = E.renderbytes;
 }
 
 // Insert a new Row
 void editorInsertRow(int at, char *s, size_t len) {
+  // validating the index
+  if (at < 0 || at > E.numrows) {
+    return;
+  }
+  editorRowsOwn();
   // Reallocate(Resize Memory Block) to accomadate a new erow in E.row array
   E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
   // shufting all the erow from 'at' index to 'at+1' index
@@ -327,28 +1050,34 @@ void editorInsertRow(int at, char *s, size_t len) {
   // Setting the Size of Line in a Row
   E.row[at].size = len;
   // Allocating Memory for Character of the Line in a Row
-  E.row[at].chars = malloc(len + 1);
+  E.row[at].blk = blockNew(len);
+  E.row[at].chars = blockData(E.row[at].blk);
   // Copying Characters from line to Line in a Row
   memcpy(E.row[at].chars, s, len);
   // Adding the Ending chracter to the copied Characters
   E.row[at].chars[len] = '\0';
 
-  // For Rendering Special Characters
+  // For Rendering Special Characters - filled in when drawn
   E.row[at].rsize = 0;
   E.row[at].render = NULL;
-  // Filling E.row.render using E.row.chars
-  editorUpdateRow(&E.row[at]);
+  E.row[at].nwrap = 0;
+  E.row[at].wrap = NULL;
+  // Not in the file yet
+  E.row[at].dsize = -1;
+  E.row[at].epoch = E.epoch;
 
   // Incrementing the Row Count
   E.numrows++;
+  editorRowShifted(at, 1);
 
-  E.dirty++;
+  editorMarkDirty();
 }
 
 // free a row
 void editorFreeRow(erow *row) {
-  free(row->render);
-  free(row->chars);
+  editorDropRender(row);
+  editorDropWrap(row);
+  blockUnref(row->blk);
 }
 
 // Delete a erow
@@ -357,12 +1086,14 @@ void editorDelRow(int at) {
   if (at < 0 || at >= E.numrows) {
     return;
   }
+  editorRowsOwn();
+  editorRowShifted(at, -1);
   // free the memory used by erow on index 'at'
   editorFreeRow(&E.row[at]);
   // rewrite the all rows after index 'at'
   memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
   E.numrows--;
-  E.dirty++;
+  editorMarkDirty();
 }
 
 // Insert a char in erow
@@ -371,27 +1102,29 @@ void editorRowInsertChar(erow *row, int at, int c) {
     at = row->size;
   }
   // allocating 1 byte for new character (1 for new char + 1 for NULL)
-  row->chars = realloc(row->chars, row->size + 2);
+  row = editorRowReserve(row, row->size + 1);
   // moves characters from at to at+1 so we can insert new chracter
   memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
   // inserting 'c'
   row->size++;
   row->chars[at] = c;
   editorUpdateRow(row);
-  E.dirty++;
+  editorRowChanged(row);
+  editorMarkDirty();
 }
 
 // Append a string to row
 void editorRowAppendString(erow *row, char *s, size_t len) {
   // creating space for the string to be appended to row
-  row->chars = realloc(row->chars, row->size + len + 1);
+  row = editorRowReserve(row, row->size + len);
   // copying the string
   memcpy(&row->chars[row->size], s, len);
   row->size += len;
   row->chars[row->size] = '\0';
   // udpating row
   editorUpdateRow(row);
-  E.dirty++;
+  editorRowChanged(row);
+  editorMarkDirty();
 }
 
 // Delete char in erow
@@ -401,10 +1134,12 @@ void editorRowDelChar(erow *row, int at) {
   }
 
   // move the chracters from at+1 to at -> removing the character
+  row = editorRowReserve(row, row->size);
   memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
   row->size--;
   editorUpdateRow(row);
-  E.dirty++;
+  editorRowChanged(row);
+  editorMarkDirty();
 }
 
 /*** editor operations ***/
@@ -414,241 +1149,2324 @@ void editorInsertChar(int c) {
     // inserting a new row because the editor is at the EOF on tilde line
     editorInsertRow(E.numrows, "", 0);
   }
-  // inserting a new character at cusror position (E.cx,E,cy)
-  editorRowInsertChar(&E.row[E.cy], E.cx, c);
-  // moving cursor forward after inserting the character
-  E.cx++;
+  // inserting a new character at cusror position (E.cx,E,cy)
+  editorRowInsertChar(&E.row[E.cy], E.cx, c);
+  // moving cursor forward after inserting the character
+  E.cx++;
+}
+
+// Insert a New Line
+void editorInsertNewLine() {
+  // Insert an Empty line if at the beginning of the Line
+  if (E.cx == 0) {
+    editorInsertRow(E.cy, "", 0);
+  }
+  // Spilting the Row at cursor's x (E.cx) into two Rows
+  else {
+    erow *row = &E.row[E.cy];
+    // Inserting a new row after E.cy with contents to right of E.cx
+    editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
+    // Getting the Current Row Pointer
+    row = &E.row[E.cy];
+    // Resetting the Size of Current Row
+    row = editorRowReserve(row, row->size);
+    row->size = E.cx;
+    // Adding NULL to the end
+    row->chars[row->size] = '\0';
+    editorUpdateRow(row);
+    editorRowChanged(row);
+  }
+  // Moving to the Start of the Inserted Line
+  E.cy++;
+  E.cx = 0;
+}
+
+void editorDelChar() {
+  // nothing to delete at EOF
+  if (E.cy == E.numrows) {
+    return;
+  }
+  // nothing to delete if the cursor is at the beginning of the line
+  if (E.cx == 0 && E.cy == 0) {
+    return;
+  }
+
+  // getting the current row
+  erow *row = &E.row[E.cy];
+  // get the row the cursor is on
+  // and if there is character left to cursor delete it
+  if (E.cx > 0) {
+    editorRowDelChar(row, E.cx - 1);
+    E.cx--;
+  } else {
+    // Set Cursor's col to above line's end
+    E.cx = E.row[E.cy - 1].size;
+    // appending the current row's chars to the end of previous row
+    editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
+    editorDelRow(E.cy);
+    // Set Cursor's row to above row
+    E.cy--;
+  }
+}
+
+/*** undo ***/
+// Start recording a bulk change
+struct editorUndo *editorUndoBegin() {
+  struct editorUndo *u = calloc(1, sizeof(*u));
+  u->before = E.changes;
+  u->cx = E.cx;
+  u->cy = E.cy;
+  return u;
+}
+
+// Record that the rows [at, at + oldcount) are about to be replaced by
+// 'newcount' rows. Pieces are recorded in the order they are applied
+void editorUndoSave(struct editorUndo *u, int at, int oldcount,
+                    int newcount) {
+  // growing the arrays geometrically, a change may have many pieces
+  if (u->numpieces == u->cappieces) {
+    u->cappieces = u->cappieces ? u->cappieces * 2 : 16;
+    u->pieces = realloc(u->pieces, sizeof(struct undoPiece) * u->cappieces);
+  }
+  struct undoPiece *p = &u->pieces[u->numpieces++];
+  p->at = at;
+  p->oldcount = oldcount;
+  p->newcount = newcount;
+  p->first = u->numrows;
+
+  if (u->numrows + oldcount > u->caprows) {
+    u->caprows = (u->numrows + oldcount) * 2;
+    u->rows = realloc(u->rows, sizeof(erow) * u->caprows);
+  }
+  if (oldcount)
+    memcpy(&u->rows[u->numrows], &E.row[at], sizeof(erow) * oldcount);
+  int j;
+  for (j = 0; j < oldcount; j++) {
+    erow *row = &u->rows[u->numrows + j];
+    blockRef(row->blk);
+    row->render = NULL;
+    row->rsize = 0;
+    row->wrap = NULL;
+    row->nwrap = 0;
+  }
+  u->numrows += oldcount;
+}
+
+void editorUndoFree(struct editorUndo *u) {
+  int j;
+  for (j = 0; j < u->numrows; j++) {
+    blockUnref(u->rows[j].blk);
+  }
+  free(u->rows);
+  free(u->pieces);
+  free(u);
+}
+
+// Forget all recorded changes
+void editorUndoClear() {
+  while (E.numundo > 0) {
+    editorUndoFree(E.undo[--E.numundo]);
+  }
+}
+
+// Finish recording a bulk change that has been applied to E.row
+void editorUndoCommit(struct editorUndo *u) {
+  editorMarkDirty();
+  u->after = E.changes;
+  // dropping the oldest change when the history is full
+  if (E.numundo == TEXT_UNDO_LEVELS) {
+    editorUndoFree(E.undo[0]);
+    memmove(&E.undo[0], &E.undo[1],
+            sizeof(E.undo[0]) * (TEXT_UNDO_LEVELS - 1));
+    E.numundo--;
+  }
+  E.undo[E.numundo++] = u;
+}
+
+// Revert the last bulk change
+void editorUndo() {
+  if (E.numundo == 0 || E.undo[E.numundo - 1]->after != E.changes) {
+    // other edits happened since, the recorded rows are stale
+    editorUndoClear();
+    editorSetStatusMessage("Nothing to undo");
+    return;
+  }
+  struct editorUndo *u = E.undo[--E.numundo];
+  editorRowsOwn();
+
+  int k;
+  for (k = u->numpieces - 1; k >= 0; k--) {
+    struct undoPiece *p = &u->pieces[k];
+    erow *old = &u->rows[p->first];
+    int j;
+    // rows the change didn't touch keep their render and are still clean,
+    // the others take the place of the live rows in the file
+    for (j = 0; j < p->oldcount; j++) {
+      erow *row = &E.row[p->at + j];
+      old[j].dsize = j < p->newcount ? editorRowDiskSize(row) : -1;
+      old[j].epoch = E.epoch;
+      if (j < p->newcount && row->blk == old[j].blk &&
+          row->chars == old[j].chars && row->size == old[j].size) {
+        old[j].render = row->render;
+        old[j].rsize = row->rsize;
+        old[j].epoch = row->epoch;
+        row->render = NULL;
+      }
+    }
+    if (p->oldcount != p->newcount)
+      editorRowsChanged(p->at);
+    for (j = 0; j < p->newcount; j++) {
+      editorFreeRow(&E.row[p->at + j]);
+    }
+
+    // making room for the old rows and putting them back
+    if (p->oldcount > p->newcount) {
+      E.row = realloc(E.row, sizeof(erow) *
+                                 (E.numrows + p->oldcount - p->newcount));
+    }
+    memmove(&E.row[p->at + p->oldcount], &E.row[p->at + p->newcount],
+            sizeof(erow) * (E.numrows - p->at - p->newcount));
+    E.numrows += p->oldcount - p->newcount;
+    // the live rows take over the references of the record
+    if (p->oldcount)
+      memcpy(&E.row[p->at], old, sizeof(erow) * p->oldcount);
+  }
+  free(u->rows);
+  free(u->pieces);
+  editorRowsChanged(E.numrows);
+
+  E.cx = u->cx;
+  E.cy = u->cy;
+  if (E.cy > E.numrows)
+    E.cy = E.numrows;
+  if (E.cy < E.numrows && E.cx > E.row[E.cy].size)
+    E.cx = E.row[E.cy].size;
+  // the change before this one is revertible again
+  E.dirty++;
+  E.changes = u->before;
+  free(u);
+  editorSetStatusMessage("Undo");
+}
+
+/*** file i/o ***/
+char *gzipDecompress[] = {"gzip", "-dc", NULL};
+char *gzipCompress[] = {"gzip", "-c", NULL};
+char *zstdDecompress[] = {"zstd", "-dcq", NULL};
+char *zstdCompress[] = {"zstd", "-cq", NULL};
+
+struct codec codecs[] = {
+    {"gzip", "\x1f\x8b", 2, gzipDecompress, gzipCompress},
+    {"zstd", "\x28\xb5\x2f\xfd", 4, zstdDecompress, zstdCompress},
+};
+
+// Find the codec of the file 'fd' from its first bytes, NULL if plain
+const struct codec *codecDetect(int fd) {
+  char magic[8];
+  ssize_t n = pread(fd, magic, sizeof(magic), 0);
+  unsigned int j;
+  for (j = 0; j < sizeof(codecs) / sizeof(codecs[0]); j++) {
+    if (n >= codecs[j].magiclen &&
+        memcmp(magic, codecs[j].magic, codecs[j].magiclen) == 0)
+      return &codecs[j];
+  }
+  return NULL;
+}
+
+// Start the codec command 'argv' reading 'in' and writing 'out'
+// Returns the pid or -1 with errno set
+pid_t codecSpawn(char *const argv[], int in, int out) {
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t attr;
+  sigset_t sigs;
+  pid_t pid;
+
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_adddup2(&actions, in, STDIN_FILENO);
+  posix_spawn_file_actions_adddup2(&actions, out, STDOUT_FILENO);
+  // keeping its complaints off the editor screen
+  posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null",
+                                   O_WRONLY, 0);
+  // the editor ignores SIGPIPE, the codec shouldn't
+  posix_spawnattr_init(&attr);
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGPIPE);
+  posix_spawnattr_setsigdefault(&attr, &sigs);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+
+  int err = posix_spawnp(&pid, argv[0], &actions, &attr, argv, environ);
+  posix_spawn_file_actions_destroy(&actions);
+  posix_spawnattr_destroy(&attr);
+  if (err) {
+    errno = err;
+    return -1;
+  }
+  return pid;
+}
+
+// Wait for a codec, returns 0 if it succeeded
+int codecWait(pid_t pid) {
+  int status;
+  while (waitpid(pid, &status, 0) == -1) {
+    if (errno != EINTR)
+      return -1;
+  }
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    errno = EIO;
+    return -1;
+  }
+  return 0;
+}
+
+// Add a row read from the file after the last one
+void editorLoadRow(char *s, int len) {
+  struct editorLoad *l = &E.load;
+  // carriage returns are dropped, saving writes plain newlines
+  int stripped = 0;
+  while (len > 0 && s[len - 1] == '\r') {
+    len--;
+    stripped++;
+  }
+  if (stripped)
+    l->exact = 0;
+
+  // rows are only appended while loading, E.row grows geometrically
+  if (E.numrows == l->rowcap) {
+    l->rowcap = l->rowcap ? l->rowcap * 2 : 1024;
+    E.row = realloc(E.row, sizeof(erow) * l->rowcap);
+  }
+  erow *row = &E.row[E.numrows++];
+  row->size = len;
+  row->blk = blockNew(len);
+  row->chars = blockData(row->blk);
+  memcpy(row->chars, s, len);
+  row->chars[len] = '\0';
+  row->render = NULL;
+  row->rsize = 0;
+  row->wrap = NULL;
+  row->nwrap = 0;
+  // on disk already
+  row->dsize = len;
+  row->epoch = 0;
+
+  if (E.offsets.valid)
+    fenwickAppend(&E.offsets, len + 1);
+  if (E.vlines.valid)
+    fenwickAppend(&E.vlines, editorRowWrap(row));
+}
+
+// The whole file is in E.row
+void editorLoadDone() {
+  struct editorLoad *l = &E.load;
+  // a last line without newline
+  if (l->len > 0) {
+    editorLoadRow(l->buf, l->len);
+    l->exact = 0;
+  }
+  close(l->fd);
+  l->fd = -1;
+  free(l->buf);
+  l->buf = NULL;
+  if (l->pid != -1 && codecWait(l->pid) == -1)
+    editorSetStatusMessage("%s failed, the file may be incomplete",
+                           E.codec->name);
+
+  E.shiftrow = INT_MAX;
+  E.disk.valid = l->exact && E.filename != NULL;
+  E.disk.numrows = E.numrows;
+  E.disk.size = l->st.st_size;
+  E.disk.ino = l->st.st_ino;
+  E.disk.mtime = l->st.st_mtim;
+}
+
+// Read for up to 'ms' milliseconds, or until no more input is ready
+void editorLoadMore(int ms) {
+  struct editorLoad *l = &E.load;
+  struct timespec t0, t;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  while (l->fd != -1) {
+    // splitting the complete lines off the buffer
+    char *p = l->buf, *end = l->buf + l->len, *nl;
+    while (p < end && (nl = memchr(p, '\n', end - p)) != NULL) {
+      editorLoadRow(p, nl - p);
+      p = nl + 1;
+    }
+    l->len = end - p;
+    if (l->len > 0)
+      memmove(l->buf, p, l->len);
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    if ((t.tv_sec - t0.tv_sec) * 1000 + (t.tv_nsec - t0.tv_nsec) / 1000000 >=
+        ms)
+      break;
+
+    // making room for a chunk, long lines grow the buffer
+    if (l->cap - l->len < TEXT_LOAD_CHUNK) {
+      l->cap = l->cap * 2 > l->len + TEXT_LOAD_CHUNK ? l->cap * 2
+                                                     : l->len + TEXT_LOAD_CHUNK;
+      l->buf = realloc(l->buf, l->cap);
+    }
+    ssize_t n = read(l->fd, &l->buf[l->len], l->cap - l->len);
+    if (n == -1 && (errno == EAGAIN || errno == EINTR))
+      break;
+    if (n == -1)
+      editorSetStatusMessage("Can't read the file : %s", strerror(errno));
+    if (n <= 0) {
+      editorLoadDone();
+      break;
+    }
+    l->len += n;
+    l->bytes += n;
+  }
+}
+
+// Start loading the text of 'fd'. The first slice is read right away,
+// the rest in between key presses by editorReadKey
+void editorLoad(int fd) {
+  struct editorLoad *l = &E.load;
+  if (fstat(fd, &l->st) == -1)
+    die("fstat");
+  l->total = S_ISREG(l->st.st_mode) ? l->st.st_size : -1;
+
+  // compressed files are decompressed through a pipe while reading
+  l->pid = -1;
+  E.codec = S_ISREG(l->st.st_mode) ? codecDetect(fd) : NULL;
+  if (E.codec) {
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) == -1)
+      die("pipe");
+    pid_t pid = codecSpawn(E.codec->decompress, fd, pipefd[1]);
+    if (pid == -1)
+      die(E.codec->name);
+    close(pipefd[1]);
+    close(fd);
+    fd = pipefd[0];
+    l->pid = pid;
+    l->total = -1;
+  }
+  // reads must not block the keys
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+  l->fd = fd;
+  l->buf = NULL;
+  l->len = l->cap = 0;
+  l->bytes = 0;
+  // the rows only mirror the file byte for byte if every line ends in
+  // a single '\n'
+  l->exact = E.codec == NULL;
+  l->rowcap = E.numrows;
+  E.dirty = 0;
+  editorLoadMore(TEXT_LOAD_SLICE);
+}
+
+void editorOpen(char *filename) {
+  // Storing File Name in editor config
+  free(E.filename);
+  E.filename = strdup(filename);
+
+  int fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    die("open");
+  editorLoad(fd);
+}
+
+// Write 'len' bytes at file offset 'off', or at the current position
+// (pipes) when 'off' is -1, retrying on short writes
+int writeAt(int fd, const char *buf, size_t len, long long off) {
+  while (len > 0) {
+    ssize_t n = off < 0 ? write(fd, buf, len) : pwrite(fd, buf, len, off);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    buf += n;
+    len -= n;
+    if (off >= 0)
+      off += n;
+  }
+  return 0;
+}
+
+// Staging buffer of the writer thread, it holds the bytes of one
+// contiguous range of the file starting at 'off'
+struct saveBuffer {
+  char *b;
+  size_t len;
+  long long off;
+};
+
+// Send the staged bytes to the file
+int editorSaveFlush(struct editorSaveJob *job, int fd, struct saveBuffer *sb) {
+  if (sb->len == 0)
+    return 0;
+  if (writeAt(fd, sb->b, sb->len, job->codec ? -1 : sb->off) == -1)
+    return -1;
+  pthread_mutex_lock(&job->lock);
+  job->written += sb->len;
+  pthread_mutex_unlock(&job->lock);
+  sb->len = 0;
+  return 0;
+}
+
+// Writer thread - streams the snapshot rows to the file through a
+// staging buffer so the UI thread never blocks on the disk. A patch only
+// writes the changed rows and the tail over the existing file, otherwise
+// a new file is written next to it and renamed over it once complete,
+// unless the file has to be rewritten in place
+void *editorSaveThread(void *arg) {
+  struct editorSaveJob *job = arg;
+  struct saveBuffer sb = {malloc(TEXT_SAVE_CHUNK), 0, 0};
+  int err = sb.b ? 0 : ENOMEM;
+  int file = -1;
+  pid_t pid = -1;
+
+  if (!err) {
+    if (job->patch) {
+      file = open(job->filename, O_WRONLY | O_CLOEXEC);
+    } else if (job->inplace) {
+      file = open(job->filename, O_WRONLY | O_TRUNC | O_CLOEXEC);
+    } else {
+      file = mkostemp(job->tmpname, O_CLOEXEC);
+      if (file != -1 && fchmod(file, job->mode) == -1)
+        err = errno;
+    }
+    if (file == -1)
+      err = errno;
+  }
+  // compressed files - the rows go through a pipe into the compressor
+  int fd = file;
+  if (!err && job->codec) {
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) == -1) {
+      err = errno;
+    } else {
+      pid = codecSpawn(job->codec->compress, pipefd[0], file);
+      if (pid == -1)
+        err = errno;
+      close(pipefd[0]);
+      fd = pipefd[1];
+    }
+  }
+
+  long long off = 0; // offset of the row in the file
+  int j;
+  for (j = 0; !err && j < job->numrows; j++) {
+    erow *row = &job->rows[j];
+    long long rowoff = off;
+    off += row->size + 1;
+    // patching - unchanged rows that didn't move are already on disk
+    if (job->patch && j < job->stable && row->epoch <= job->since)
+      continue;
+
+    // flushing when the row doesn't continue the staged range or fit in it
+    if (sb.len && (sb.off + (long long)sb.len != rowoff ||
+                   sb.len + row->size + 1 > TEXT_SAVE_CHUNK)) {
+      if (editorSaveFlush(job, fd, &sb) == -1) {
+        err = errno;
+        break;
+      }
+    }
+    if (sb.len == 0)
+      sb.off = rowoff;
+    // rows larger than the staging buffer are written directly
+    if (row->size + 1 > TEXT_SAVE_CHUNK) {
+      if (writeAt(fd, row->chars, row->size, job->codec ? -1 : rowoff) ==
+              -1 ||
+          writeAt(fd, "\n", 1, job->codec ? -1 : rowoff + row->size) == -1) {
+        err = errno;
+        break;
+      }
+      pthread_mutex_lock(&job->lock);
+      job->written += row->size + 1;
+      pthread_mutex_unlock(&job->lock);
+      continue;
+    }
+    memcpy(&sb.b[sb.len], row->chars, row->size);
+    sb.len += row->size;
+    sb.b[sb.len++] = '\n';
+  }
+  if (!err && editorSaveFlush(job, fd, &sb) == -1)
+    err = errno;
+  // a patch may leave the file shorter than it was
+  if (!err && job->patch && ftruncate(file, job->size) == -1)
+    err = errno;
+  if (fd != file && close(fd) == -1 && !err)
+    err = errno;
+  if (pid != -1 && codecWait(pid) == -1 && !err)
+    err = errno;
+  // remembering what the file looks like now, for the next patch
+  if (!err && fstat(file, &job->st) == -1)
+    err = errno;
+  if (file != -1 && close(file) == -1 && !err)
+    err = errno;
+  if (!job->patch && !job->inplace && file != -1) {
+    if (!err && rename(job->tmpname, job->filename) == -1)
+      err = errno;
+    if (err)
+      unlink(job->tmpname);
+  }
+  free(sb.b);
+
+  pthread_mutex_lock(&job->lock);
+  job->err = err;
+  job->done = 1;
+  pthread_mutex_unlock(&job->lock);
+  return NULL;
+}
+
+// Release the snapshot of a finished save and report the result
+void editorFinishSave() {
+  struct editorSaveJob *job = E.save;
+  if (job->threaded)
+    pthread_join(job->thread, NULL);
+
+  int j;
+  for (j = 0; j < job->numfreed; j++) {
+    free(job->freed[j]);
+  }
+  if (job->err == 0) {
+    // only the edits made before the snapshot are on disk now
+    E.dirty -= job->dirty;
+    if (E.dirty < 0)
+      E.dirty = 0;
+    E.clean = job->clean;
+    E.disk.valid = job->codec == NULL;
+    E.disk.numrows = job->numrows;
+    E.disk.size = job->size;
+    E.disk.ino = job->st.st_ino;
+    E.disk.mtime = job->st.st_mtim;
+    if (job->patch)
+      editorSetStatusMessage("%lld bytes patched in place", job->total);
+    else if (job->codec)
+      editorSetStatusMessage("%lld bytes written to disk (%s)", job->total,
+                             job->codec->name);
+    else
+      editorSetStatusMessage("%lld bytes written to disk", job->total);
+  } else {
+    // the file is in an unknown state, the next save rewrites it
+    E.disk.valid = 0;
+    editorSetStatusMessage("Can't save ! I/O error : %s", strerror(job->err));
+  }
+
+  pthread_mutex_destroy(&job->lock);
+  if (job->rows != E.row)
+    free(job->rows);
+  free(job->freed);
+  free(job->filename);
+  free(job->tmpname);
+  free(job);
+  E.save = NULL;
+}
+
+// Check on the background save, returns 1 if the screen needs a refresh
+int editorPollSave() {
+  struct editorSaveJob *job = E.save;
+  if (job == NULL)
+    return 0;
+
+  pthread_mutex_lock(&job->lock);
+  long long written = job->written;
+  int done = job->done;
+  pthread_mutex_unlock(&job->lock);
+
+  if (done) {
+    editorFinishSave();
+    return 1;
+  }
+  int percent = job->total ? (int)(written * 100 / job->total) : 100;
+  if (percent == job->percent)
+    return 0;
+  job->percent = percent;
+  editorSetStatusMessage("Saving %.20s... %d%%", job->filename, percent);
+  return 1;
+}
+
+// Block until the background save (if any) is done
+void editorWaitSave() {
+  if (E.save == NULL)
+    return;
+  editorSetStatusMessage("Waiting for save to finish...");
+  editorRefreshScreen();
+  editorFinishSave();
+}
+
+// Whether a new file can be created next to 'path'
+int editorDirWritable(const char *path) {
+  const char *slash = strrchr(path, '/');
+  if (slash == NULL)
+    return access(".", W_OK) == 0;
+  if (slash == path)
+    return access("/", W_OK) == 0;
+  char *dir = strndup(path, slash - path);
+  int writable = access(dir, W_OK) == 0;
+  free(dir);
+  return writable;
+}
+
+// Whether saving has to rewrite the existing file ('st' is its stat)
+// rather than rename a new one over it: renaming would replace a symlink
+// by a regular file, split hard links, drop an owner we can't set, or
+// not be allowed at all in a read-only directory
+int editorSaveInPlace(struct stat *st) {
+  struct stat lst;
+  return (lstat(E.filename, &lst) == 0 && S_ISLNK(lst.st_mode)) ||
+         st->st_nlink > 1 || st->st_uid != geteuid() ||
+         st->st_gid != getegid() || !editorDirWritable(E.filename);
+}
+
+// Whether the file still is what we last read or wrote ('st' is its
+// stat), so that it can be patched
+int editorDiskUnchanged(struct stat *st) {
+  return E.disk.valid && access(E.filename, W_OK) == 0 &&
+         st->st_size == E.disk.size && st->st_ino == E.disk.ino &&
+         st->st_mtim.tv_sec == E.disk.mtime.tv_sec &&
+         st->st_mtim.tv_nsec == E.disk.mtime.tv_nsec;
+}
+
+void editorSave() {
+  if (E.save) {
+    editorSetStatusMessage("Save already in progress");
+    return;
+  }
+  if (E.filename == NULL) {
+    E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL, 0);
+    if (E.filename == NULL) {
+      editorSetStatusMessage("Save aborted");
+      return;
+    }
+  }
+
+  // snapshot of the rows - shares E.row and the characters instead of
+  // copying them, editorRowsOwn() and editorRowReserve() copy them on the
+  // first change instead
+  struct editorSaveJob *job = calloc(1, sizeof(*job));
+  job->filename = strdup(E.filename);
+  job->tmpname = malloc(strlen(E.filename) + 8);
+  sprintf(job->tmpname, "%s.XXXXXX", E.filename);
+  job->codec = E.codec;
+  job->numrows = E.numrows;
+  job->rows = E.row;
+  job->dirty = E.dirty;
+  job->percent = -1;
+
+  // a new file gets the permissions of the one it replaces
+  struct stat st;
+  int exists = stat(E.filename, &st) == 0;
+  job->mode = exists ? st.st_mode & 07777 : 0644;
+
+  // rows in front of 'stable' still sit at their offsets in the file
+  int stable = E.numrows < E.disk.numrows ? E.numrows : E.disk.numrows;
+  if (E.shiftrow < stable)
+    stable = E.shiftrow;
+  long long stableoff = 0;
+  int j;
+  for (j = 0; j < stable && E.row[j].size == editorRowDiskSize(&E.row[j]);
+       j++) {
+    stableoff += E.row[j].size + 1;
+  }
+  job->stable = j;
+  // patching in place when no more than the tail of the file moved
+  job->patch = exists && editorDiskUnchanged(&st) && E.codec == NULL &&
+               E.disk.size - stableoff <= TEXT_PATCH_TAIL;
+  job->inplace = !job->patch && exists && editorSaveInPlace(&st);
+  job->since = E.clean;
+  job->clean = E.epoch;
+
+  for (j = 0; j < E.numrows; j++) {
+    erow *row = &E.row[j];
+    if (!job->patch || j >= job->stable || row->epoch > job->since)
+      job->total += row->size + 1;
+    job->size += row->size + 1;
+  }
+  // edits from now on are not part of this save, once written the rows
+  // from before are the layout of the file (see editorRowDiskSize)
+  E.epoch++;
+  E.shiftrow = INT_MAX;
+  pthread_mutex_init(&job->lock, NULL);
+
+  E.save = job;
+  job->threaded =
+      pthread_create(&job->thread, NULL, editorSaveThread, job) == 0;
+  if (!job->threaded) {
+    // no thread available - write the snapshot on the UI thread instead
+    editorSaveThread(job);
+  }
+  editorPollSave();
+}
+
+/*** regex ***/
+// Regular expressions for search: . [] [^] * + ? | () ^ $ and the \d \w \s
+// (\D \W \S) escapes. A pattern is compiled to a Thompson NFA and run as a
+// DFA whose states are built lazily on first use, so a scan is linear in
+// the length of the row and never backtracks. The NFA is built for the
+// reversed pattern: scanning a row from its end, the last position where
+// the DFA accepts is the leftmost match start
+enum reType { RE_CHAR, RE_SPLIT, RE_BEGIN, RE_END, RE_MATCH };
+
+// Parsed pattern
+enum reAstType { AST_SET, AST_CAT, AST_ALT, AST_STAR, AST_PLUS, AST_QUEST,
+                 AST_BOL, AST_EOL, AST_EMPTY };
+
+typedef struct reast {
+  int type;
+  int left, right;       // sub expressions (index into the ast array)
+  unsigned char set[32]; // bytes matched by AST_SET
+} reast;
+
+// NFA state
+typedef struct renode {
+  int type;
+  int out, out1;         // next states (out1 only for RE_SPLIT)
+  unsigned char set[32]; // bytes accepted by RE_CHAR
+} renode;
+
+// DFA state - a set of NFA states
+typedef struct dstate {
+  int *nfa;      // sorted NFA states after the epsilon closure
+  int n;
+  int match;     // contains RE_MATCH
+  int next[256]; // transition on each byte, -1 when not built yet
+} dstate;
+
+typedef struct regex {
+  renode *node;
+  int nnodes;
+  int start;
+  dstate *dfa; // DFA states built so far
+  int ndfa;
+  int *hash;   // open addressing table of dfa index + 1
+  int dstart;  // DFA state at the start of a scan, -1 if not built
+  int *mark;   // closure work space
+  int gen;
+  int *stack;
+  int *list;
+} regex;
+
+struct reparser {
+  const char *p;
+  reast *ast;
+  int nast;
+  const char *err;
+};
+
+int reNewAst(struct reparser *rp, int type, int left, int right) {
+  rp->ast = realloc(rp->ast, sizeof(reast) * (rp->nast + 1));
+  reast *a = &rp->ast[rp->nast];
+  a->type = type;
+  a->left = left;
+  a->right = right;
+  memset(a->set, 0, sizeof(a->set));
+  return rp->nast++;
+}
+
+void reSetAdd(unsigned char *set, int c) { set[c >> 3] |= 1 << (c & 7); }
+
+// Add the class of a \d \w \s escape, returns 0 if 'c' is not one
+int reSetEscape(unsigned char *set, int c) {
+  int lower = tolower(c);
+  if (lower != 'd' && lower != 'w' && lower != 's')
+    return 0;
+  int j;
+  for (j = 0; j < 256; j++) {
+    int in = (lower == 'd' && isdigit(j)) ||
+             (lower == 'w' && (isalnum(j) || j == '_')) ||
+             (lower == 's' && isspace(j));
+    // upper case escapes are the negated class
+    if (in != (c != lower))
+      reSetAdd(set, j);
+  }
+  return 1;
+}
+
+int reParseAlt(struct reparser *rp);
+
+// Parse a [...] class, rp->p is just after the '['
+int reParseClass(struct reparser *rp) {
+  int a = reNewAst(rp, AST_SET, -1, -1);
+  unsigned char set[32];
+  memset(set, 0, sizeof(set));
+  int negate = 0;
+  if (*rp->p == '^') {
+    negate = 1;
+    rp->p++;
+  }
+  int first = 1;
+  while (*rp->p && (*rp->p != ']' || first)) {
+    int c = (unsigned char)*rp->p++;
+    first = 0;
+    if (c == '\\' && *rp->p) {
+      c = (unsigned char)*rp->p++;
+      if (reSetEscape(set, c))
+        continue;
+    }
+    // range a-z
+    if (rp->p[0] == '-' && rp->p[1] && rp->p[1] != ']') {
+      int hi = (unsigned char)rp->p[1];
+      rp->p += 2;
+      if (hi == '\\' && *rp->p)
+        hi = (unsigned char)*rp->p++;
+      for (; c <= hi; c++)
+        reSetAdd(set, c);
+      continue;
+    }
+    reSetAdd(set, c);
+  }
+  if (*rp->p != ']') {
+    rp->err = "missing ]";
+    return -1;
+  }
+  rp->p++;
+  int j;
+  for (j = 0; j < 32; j++) {
+    rp->ast[a].set[j] = negate ? ~set[j] : set[j];
+  }
+  return a;
+}
+
+int reParseAtom(struct reparser *rp) {
+  int c = (unsigned char)*rp->p++;
+  int a;
+  switch (c) {
+  case '(':
+    a = reParseAlt(rp);
+    if (a == -1)
+      return -1;
+    if (*rp->p != ')') {
+      rp->err = "missing )";
+      return -1;
+    }
+    rp->p++;
+    return a;
+  case '[':
+    return reParseClass(rp);
+  case '.':
+    a = reNewAst(rp, AST_SET, -1, -1);
+    memset(rp->ast[a].set, 0xff, sizeof(rp->ast[a].set));
+    return a;
+  case '^':
+    return reNewAst(rp, AST_BOL, -1, -1);
+  case '$':
+    return reNewAst(rp, AST_EOL, -1, -1);
+  case '*':
+  case '+':
+  case '?':
+    rp->err = "nothing to repeat";
+    return -1;
+  case '\\':
+    if (*rp->p == '\0') {
+      rp->err = "trailing \\";
+      return -1;
+    }
+    c = (unsigned char)*rp->p++;
+    a = reNewAst(rp, AST_SET, -1, -1);
+    if (!reSetEscape(rp->ast[a].set, c))
+      reSetAdd(rp->ast[a].set, c);
+    return a;
+  default:
+    a = reNewAst(rp, AST_SET, -1, -1);
+    reSetAdd(rp->ast[a].set, c);
+    return a;
+  }
+}
+
+int reParseRepeat(struct reparser *rp) {
+  int a = reParseAtom(rp);
+  while (a != -1 && (*rp->p == '*' || *rp->p == '+' || *rp->p == '?')) {
+    int type = *rp->p == '*' ? AST_STAR : *rp->p == '+' ? AST_PLUS : AST_QUEST;
+    rp->p++;
+    a = reNewAst(rp, type, a, -1);
+  }
+  return a;
+}
+
+int reParseCat(struct reparser *rp) {
+  int a = reNewAst(rp, AST_EMPTY, -1, -1);
+  while (*rp->p && *rp->p != '|' && *rp->p != ')') {
+    int b = reParseRepeat(rp);
+    if (b == -1)
+      return -1;
+    a = reNewAst(rp, AST_CAT, a, b);
+  }
+  return a;
+}
+
+int reParseAlt(struct reparser *rp) {
+  int a = reParseCat(rp);
+  while (a != -1 && *rp->p == '|') {
+    rp->p++;
+    int b = reParseCat(rp);
+    if (b == -1)
+      return -1;
+    a = reNewAst(rp, AST_ALT, a, b);
+  }
+  return a;
+}
+
+int reNewNode(regex *re, int type, int out, int out1) {
+  re->node = realloc(re->node, sizeof(renode) * (re->nnodes + 1));
+  renode *n = &re->node[re->nnodes];
+  n->type = type;
+  n->out = out;
+  n->out1 = out1;
+  return re->nnodes++;
+}
+
+// Emit the NFA of the reversed expression 'a' continuing to state 'next',
+// returns the entry state
+int reEmit(regex *re, reast *ast, int a, int next) {
+  int s;
+  switch (ast[a].type) {
+  case AST_SET:
+    s = reNewNode(re, RE_CHAR, next, -1);
+    memcpy(re->node[s].set, ast[a].set, sizeof(ast[a].set));
+    return s;
+  case AST_CAT:
+    // reversed - the right side is scanned first
+    return reEmit(re, ast, ast[a].right, reEmit(re, ast, ast[a].left, next));
+  case AST_ALT: {
+    int l = reEmit(re, ast, ast[a].left, next);
+    int r = reEmit(re, ast, ast[a].right, next);
+    return reNewNode(re, RE_SPLIT, l, r);
+  }
+  case AST_STAR: {
+    s = reNewNode(re, RE_SPLIT, -1, next);
+    int body = reEmit(re, ast, ast[a].left, s);
+    re->node[s].out = body;
+    return s;
+  }
+  case AST_PLUS: {
+    s = reNewNode(re, RE_SPLIT, -1, next);
+    int body = reEmit(re, ast, ast[a].left, s);
+    re->node[s].out = body;
+    return body;
+  }
+  case AST_QUEST:
+    return reNewNode(re, RE_SPLIT, reEmit(re, ast, ast[a].left, next), next);
+  // anchors swap sides when scanning backwards
+  case AST_BOL:
+    return reNewNode(re, RE_END, next, -1);
+  case AST_EOL:
+    return reNewNode(re, RE_BEGIN, next, -1);
+  default:
+    return next;
+  }
+}
+
+// Compile 'pattern', returns NULL and sets *err if it is invalid
+regex *regexCompile(const char *pattern, const char **err) {
+  struct reparser rp = {pattern, NULL, 0, NULL};
+  int root = reParseAlt(&rp);
+  if (root != -1 && *rp.p != '\0')
+    rp.err = "unmatched )";
+  if (rp.err) {
+    free(rp.ast);
+    *err = rp.err;
+    return NULL;
+  }
+
+  regex *re = calloc(1, sizeof(regex));
+  int match = reNewNode(re, RE_MATCH, -1, -1);
+  re->start = reEmit(re, rp.ast, root, match);
+  free(rp.ast);
+
+  re->hash = malloc(sizeof(int) * TEXT_DFA_MAX_STATES * 2);
+  memset(re->hash, 0, sizeof(int) * TEXT_DFA_MAX_STATES * 2);
+  re->dstart = -1;
+  re->mark = calloc(re->nnodes, sizeof(int));
+  re->stack = malloc(sizeof(int) * (re->nnodes * 2 + 1));
+  re->list = malloc(sizeof(int) * re->nnodes);
+  return re;
+}
+
+// Drop all DFA states, used when the cache is full
+void regexFlush(regex *re) {
+  int j;
+  for (j = 0; j < re->ndfa; j++) {
+    free(re->dfa[j].nfa);
+  }
+  re->ndfa = 0;
+  re->dstart = -1;
+  memset(re->hash, 0, sizeof(int) * TEXT_DFA_MAX_STATES * 2);
+}
+
+void regexFree(regex *re) {
+  if (re == NULL)
+    return;
+  regexFlush(re);
+  free(re->dfa);
+  free(re->hash);
+  free(re->node);
+  free(re->mark);
+  free(re->stack);
+  free(re->list);
+  free(re);
+}
+
+// Add the epsilon closure of state 's' to re->list. 'begin' and 'end' tell
+// if the scan is at its first/last position, for the anchors
+void reAddClosure(regex *re, int s, int begin, int end, int *n) {
+  int sp = 0;
+  re->stack[sp++] = s;
+  while (sp) {
+    s = re->stack[--sp];
+    if (re->mark[s] == re->gen)
+      continue;
+    re->mark[s] = re->gen;
+    renode *node = &re->node[s];
+    switch (node->type) {
+    case RE_SPLIT:
+      re->stack[sp++] = node->out1;
+      re->stack[sp++] = node->out;
+      break;
+    case RE_BEGIN:
+      if (begin)
+        re->stack[sp++] = node->out;
+      break;
+    case RE_END:
+      // kept pending until we know whether the scan ends here
+      if (end)
+        re->stack[sp++] = node->out;
+      else
+        re->list[(*n)++] = s;
+      break;
+    default:
+      re->list[(*n)++] = s;
+    }
+  }
+}
+
+int reCompareInt(const void *a, const void *b) {
+  return *(const int *)a - *(const int *)b;
+}
+
+// Find or create the DFA state for the 'n' NFA states in re->list
+// Sets *flushed if the cache had to be emptied to make room
+int reDfaState(regex *re, int n, int *flushed) {
+  qsort(re->list, n, sizeof(int), reCompareInt);
+  unsigned int h = 2166136261u;
+  int j;
+  for (j = 0; j < n; j++) {
+    h = (h ^ re->list[j]) * 16777619u;
+  }
+  int mask = TEXT_DFA_MAX_STATES * 2 - 1;
+  int slot = h & mask;
+  while (re->hash[slot]) {
+    dstate *d = &re->dfa[re->hash[slot] - 1];
+    if (d->n == n && memcmp(d->nfa, re->list, sizeof(int) * n) == 0)
+      return re->hash[slot] - 1;
+    slot = (slot + 1) & mask;
+  }
+
+  if (re->ndfa == TEXT_DFA_MAX_STATES) {
+    regexFlush(re);
+    *flushed = 1;
+    slot = h & mask;
+  }
+  if ((re->ndfa & (re->ndfa - 1)) == 0) {
+    // growing the state array in powers of two
+    re->dfa = realloc(re->dfa, sizeof(dstate) * (re->ndfa ? re->ndfa * 2 : 1));
+  }
+  dstate *d = &re->dfa[re->ndfa];
+  d->nfa = malloc(sizeof(int) * (n ? n : 1));
+  memcpy(d->nfa, re->list, sizeof(int) * n);
+  d->n = n;
+  d->match = 0;
+  for (j = 0; j < n; j++) {
+    if (re->node[d->nfa[j]].type == RE_MATCH)
+      d->match = 1;
+  }
+  memset(d->next, -1, sizeof(d->next));
+  re->hash[slot] = ++re->ndfa;
+  return re->ndfa - 1;
+}
+
+// DFA state at the start of a scan
+int reStartState(regex *re) {
+  if (re->dstart == -1) {
+    int n = 0, flushed = 0;
+    re->gen++;
+    reAddClosure(re, re->start, 1, 0, &n);
+    re->dstart = reDfaState(re, n, &flushed);
+  }
+  return re->dstart;
+}
+
+// Build the transition of DFA state 'd' on byte 'c'
+int reStep(regex *re, int d, int c) {
+  int n = 0, flushed = 0;
+  re->gen++;
+  int j;
+  for (j = 0; j < re->dfa[d].n; j++) {
+    renode *node = &re->node[re->dfa[d].nfa[j]];
+    if (node->type == RE_CHAR && (node->set[c >> 3] & (1 << (c & 7))))
+      reAddClosure(re, node->out, 0, 0, &n);
+  }
+  // unanchored - a match may begin at every position
+  reAddClosure(re, re->start, 0, 0, &n);
+  int next = reDfaState(re, n, &flushed);
+  if (!flushed)
+    re->dfa[d].next[c] = next;
+  return next;
+}
+
+// Whether state 'd' accepts when the scan ends here (pending ^ anchors)
+int reEndMatch(regex *re, int d, int begin) {
+  int n = 0;
+  re->gen++;
+  int j;
+  for (j = 0; j < re->dfa[d].n; j++) {
+    renode *node = &re->node[re->dfa[d].nfa[j]];
+    if (node->type == RE_END)
+      reAddClosure(re, node->out, begin, 1, &n);
+  }
+  for (j = 0; j < n; j++) {
+    if (re->node[re->list[j]].type == RE_MATCH)
+      return 1;
+  }
+  return 0;
+}
+
+// Index of the leftmost match in 's', or -1 if there is none
+int regexSearch(regex *re, const char *s, int len) {
+  int d = reStartState(re);
+  int found = re->dfa[d].match ? len : -1;
+  int j;
+  for (j = len - 1; j >= 0; j--) {
+    unsigned char c = s[j];
+    int next = re->dfa[d].next[c];
+    d = next != -1 ? next : reStep(re, d, c);
+    if (re->dfa[d].match)
+      found = j;
+  }
+  if (reEndMatch(re, d, len == 0))
+    found = 0;
+  return found;
+}
+
+// Compiled patterns, kept across the keystrokes of an incremental search
+regex *editorRegexCached(const char *pattern) {
+  static char *patterns[TEXT_REGEX_CACHE];
+  static regex *compiled[TEXT_REGEX_CACHE];
+  static int next = 0;
+
+  int j;
+  for (j = 0; j < TEXT_REGEX_CACHE; j++) {
+    if (patterns[j] && strcmp(patterns[j], pattern) == 0)
+      return compiled[j];
+  }
+  // replacing the oldest entry
+  free(patterns[next]);
+  regexFree(compiled[next]);
+  const char *err;
+  patterns[next] = strdup(pattern);
+  compiled[next] = regexCompile(pattern, &err);
+  regex *re = compiled[next];
+  next = (next + 1) % TEXT_REGEX_CACHE;
+  return re;
+}
+
+/*** find ***/
+// Set while the search prompt takes regular expressions
+int find_regex = 0;
+
+// Index in row->chars of the first match of 'query', -1 if none
+int editorFindInRow(erow *row, char *query) {
+  if (find_regex) {
+    regex *re = editorRegexCached(query);
+    // incomplete patterns (while typing) simply don't match
+    if (re == NULL)
+      return -1;
+    return regexSearch(re, row->chars, row->size);
+  }
+  // rows off screen are expanded into a scratch buffer, keeping the
+  // search from filling the render cache
+  static char *scratch = NULL;
+  static int scratchcap = 0;
+  char *render = row->render;
+  if (render == NULL) {
+    int cap = editorRenderCap(row);
+    if (cap > scratchcap) {
+      scratchcap = cap * 2;
+      free(scratch);
+      scratch = malloc(scratchcap);
+    }
+    editorRenderInto(row, scratch);
+    render = scratch;
+  }
+  char *match = strstr(render, query);
+  if (match == NULL)
+    return -1;
+  return editorRowRxtoCx(row, match - render);
+}
+
+void editorFindCallback(char *query, int key) {
+  // For moving forward and backward between multiple search occurences
+  // *static variables are only initialised once*
+  static int last_match = -1; // index of the last matched row
+  static int direction = 1; // direction of search 1 -> Forward  -1 -> Backward
+
+  if (key == '\r' || key == '\x1b') {
+    last_match = -1;
+    direction = 1;
+    return;
+  }
+  // Setting the Direction Based on Arrow Keys
+  else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
+    direction = 1;
+  } else if (key == ARROW_LEFT || key == ARROW_UP) {
+    direction = -1;
+  } else {
+    last_match = -1;
+    direction = 1;
+  }
+
+  if (last_match == -1) {
+    direction = 1;
+  }
+  // index of the row we are searching
+  int current = last_match;
+
+  // looping through each erow till end or
+  // we find a match
+  int i;
+  for (i = 0; i < E.numrows; i++) {
+    // incrementing the current value in 'direction' 
+    // till we find the next occurence of query
+    current += direction;
+    // To Wrap the whole file
+    if (current == -1) {
+      current = E.numrows - 1;
+    } else if (current == E.numrows) {
+      current = 0;
+    }
+    // current erow
+    erow *row = &E.row[current];
+    // fining the match
+    int match = editorFindInRow(row, query);
+    // if we found a match we move the Cursor Position to the match posiionn
+    if (match != -1) {
+      // saving the current row as the last_matched value row index
+      last_match = current;
+      E.cy = current;
+      // setting cursor 'x' to be the match position
+      E.cx = match;
+      // Setting rowOff to EOF makes E.rowOff = E.cy in editorScroll
+      E.rowoff = E.numrows;
+      break;
+    }
+  }
+}
+
+// Incremental search, 'regex' selects regular expressions over literal text
+void editorFind(int use_regex) {
+  // saving the current cursor position
+  int saved_cx = E.cx;
+  int saved_cy = E.cy;
+  int saved_coloff = E.coloff;
+  int saved_rowoff = E.rowoff;
+
+  // getting the query from User
+  // passing editorFindCallback function as a Callback Fucntion for
+  // Incremental Search
+  find_regex = use_regex;
+  char *query = editorPrompt(use_regex ? "Regex search : %s (Use ESC/Arrows/Enter)"
+                                   : "Search : %s (Use ESC/Arrows/Enter)",
+                             editorFindCallback, 0);
+  if (query) {
+    free(query);
+  } else {
+    // Restoring the Cursor Position
+    E.cx = saved_cx;
+    E.cy = saved_cy;
+    E.coloff = saved_coloff;
+    E.rowoff = saved_rowoff;
+  }
+}
+
+/*** goto ***/
+// Move the cursor to a byte offset of the file
+void editorGotoOffset(long long offset) {
+  struct fenwick *f = editorOffsets();
+  long long total = fenwickPrefix(f, E.numrows);
+  if (offset < 0)
+    offset = 0;
+  if (offset >= total) {
+    E.cy = E.numrows;
+    E.cx = 0;
+    return;
+  }
+  E.cy = fenwickSearch(f, offset);
+  E.cx = offset - fenwickPrefix(f, E.cy);
+  // an offset on the newline puts the cursor at the end of the line
+  if (E.cx > E.row[E.cy].size)
+    E.cx = E.row[E.cy].size;
+}
+
+// Jump to a line, a byte offset or a percentage of the file
+void editorGoto() {
+  char *query =
+      editorPrompt("Goto : %s (line, @byte offset or N%%) (ESC to cancel)",
+                   NULL, 0);
+  if (query == NULL)
+    return;
+
+  char *end;
+  long long n;
+  int valid = 0;
+  if (query[0] == '@') {
+    // offsets from stack traces come in hex too
+    n = strtoll(&query[1], &end, 0);
+    if (end != &query[1] && *end == '\0') {
+      editorGotoOffset(n);
+      valid = 1;
+    }
+  } else {
+    n = strtoll(query, &end, 10);
+    if (end != query && strcmp(end, "%") == 0) {
+      long long total = fenwickPrefix(editorOffsets(), E.numrows);
+      editorGotoOffset(total * n / 100);
+      valid = 1;
+    } else if (end != query && *end == '\0') {
+      if (n > E.numrows)
+        n = E.numrows;
+      E.cy = n > 0 ? n - 1 : 0;
+      E.cx = 0;
+      valid = 1;
+    }
+  }
+  if (!valid) {
+    editorSetStatusMessage("Invalid position: %s", query);
+    free(query);
+    return;
+  }
+  free(query);
+
+  // showing the target in the middle of the screen
+  E.rowoff = E.cy - E.screenrows / 2;
+  if (E.rowoff < 0)
+    E.rowoff = 0;
+}
+
+/*** bulk operations ***/
+// Number of worker threads to split 'numrows' rows between
+int editorThreads(int numrows) {
+  if (numrows < TEXT_PARALLEL_MIN_ROWS)
+    return 1;
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n < 1)
+    n = 1;
+  if (n > TEXT_MAX_THREADS)
+    n = TEXT_MAX_THREADS;
+  return n;
+}
+
+// Split the rows [from, to) into chunks and run 'fn' on each of them on
+// its own thread. Returns the finished chunks, in row order
+struct rowChunk *editorRunChunks(int from, int to, void *(*fn)(void *),
+                                 void *job, int *numchunks) {
+  int n = editorThreads(to - from);
+  struct rowChunk *chunks = calloc(n, sizeof(struct rowChunk));
+  int j;
+  for (j = 0; j < n; j++) {
+    chunks[j].from = from + (long long)(to - from) * j / n;
+    chunks[j].to = from + (long long)(to - from) * (j + 1) / n;
+    chunks[j].job = job;
+  }
+  // the first chunk runs on this thread, as does any that can't get one
+  int *started = calloc(n, sizeof(int));
+  for (j = 1; j < n; j++) {
+    started[j] = pthread_create(&chunks[j].thread, NULL, fn, &chunks[j]) == 0;
+  }
+  for (j = 0; j < n; j++) {
+    if (started[j])
+      pthread_join(chunks[j].thread, NULL);
+    else
+      fn(&chunks[j]);
+  }
+  free(started);
+  *numchunks = n;
+  return chunks;
+}
+
+void editorFreeChunks(struct rowChunk *chunks, int numchunks) {
+  int j;
+  for (j = 0; j < numchunks; j++) {
+    free(chunks[j].rows);
+    free(chunks[j].index);
+  }
+  free(chunks);
+}
+
+// Append a produced row to a chunk
+void chunkAddRow(struct rowChunk *chunk, int index, erow *row) {
+  // growing the arrays in powers of two
+  if ((chunk->numrows & (chunk->numrows - 1)) == 0) {
+    int cap = chunk->numrows ? chunk->numrows * 2 : 1;
+    chunk->rows = realloc(chunk->rows, sizeof(erow) * cap);
+    chunk->index = realloc(chunk->index, sizeof(int) * cap);
+  }
+  chunk->index[chunk->numrows] = index;
+  if (row)
+    chunk->rows[chunk->numrows] = *row;
+  chunk->numrows++;
+}
+
+struct replaceJob {
+  char *query;
+  int qlen;
+  char *with;
+  int wlen;
+};
+
+// Worker - builds the replaced version of every row of the chunk that
+// contains the query, each in a single allocation
+void *editorReplaceChunk(void *arg) {
+  struct rowChunk *chunk = arg;
+  struct replaceJob *job = chunk->job;
+  // offsets of the matches in the current row
+  int *match = NULL;
+  int matchcap = 0;
+  int j;
+  for (j = chunk->from; j < chunk->to; j++) {
+    erow *row = &E.row[j];
+    char *end = row->chars + row->size;
+    char *p = memmem(row->chars, row->size, job->query, job->qlen);
+    if (p == NULL)
+      continue;
+
+    int matches = 0;
+    while (p) {
+      if (matches == matchcap) {
+        matchcap = matchcap ? matchcap * 2 : 16;
+        match = realloc(match, sizeof(int) * matchcap);
+      }
+      match[matches++] = p - row->chars;
+      p += job->qlen;
+      p = memmem(p, end - p, job->query, job->qlen);
+    }
+    erow new;
+    new.size = row->size + matches * (job->wlen - job->qlen);
+    new.blk = blockNew(new.size);
+    new.chars = blockData(new.blk);
+    new.render = NULL;
+    new.wrap = NULL;
+    new.nwrap = 0;
+    new.dsize = editorRowDiskSize(row);
+    new.epoch = E.epoch;
+
+    // copying the text between matches and the replacement after each
+    int src = 0;
+    char *dst = new.chars;
+    int k;
+    for (k = 0; k < matches; k++) {
+      memcpy(dst, &row->chars[src], match[k] - src);
+      dst += match[k] - src;
+      memcpy(dst, job->with, job->wlen);
+      dst += job->wlen;
+      src = match[k] + job->qlen;
+    }
+    memcpy(dst, &row->chars[src], row->size - src);
+    new.chars[new.size] = '\0';
+
+    chunkAddRow(chunk, j, &new);
+    chunk->count += matches;
+  }
+  free(match);
+  return NULL;
+}
+
+// Replace every occurrence of a string in the buffer as one change
+void editorReplaceAll() {
+  struct replaceJob job;
+  job.query = editorPrompt("Replace : %s (ESC to cancel)", NULL, 0);
+  if (job.query == NULL)
+    return;
+  // replacing with nothing deletes the matches
+  job.with = editorPrompt("Replace with : %s (ESC to cancel)", NULL, 1);
+  if (job.with == NULL) {
+    free(job.query);
+    return;
+  }
+  job.qlen = strlen(job.query);
+  job.wlen = strlen(job.with);
+
+  int numchunks;
+  struct rowChunk *chunks =
+      editorRunChunks(0, E.numrows, editorReplaceChunk, &job, &numchunks);
+
+  // swapping in the new rows, recording the old ones for undo
+  struct editorUndo *u = editorUndoBegin();
+  editorRowsOwn();
+  long long count = 0;
+  int rows = 0;
+  int j, k;
+  for (j = 0; j < numchunks; j++) {
+    for (k = 0; k < chunks[j].numrows; k++) {
+      int at = chunks[j].index[k];
+      editorUndoSave(u, at, 1, 1);
+      editorFreeRow(&E.row[at]);
+      E.row[at] = chunks[j].rows[k];
+    }
+    count += chunks[j].count;
+    rows += chunks[j].numrows;
+  }
+  editorFreeChunks(chunks, numchunks);
+  editorRowsChanged(E.numrows);
+  free(job.query);
+  free(job.with);
+
+  if (rows == 0) {
+    editorUndoFree(u);
+    editorSetStatusMessage("No match found");
+    return;
+  }
+  editorUndoCommit(u);
+  if (E.cy < E.numrows && E.cx > E.row[E.cy].size)
+    E.cx = E.row[E.cy].size;
+  editorSetStatusMessage("Replaced %lld occurrences in %d lines", count, rows);
+}
+
+// Replace the 'oldcount' rows at 'at' by the 'count' rows of 'rows', as
+// one change that Ctrl-Z can revert. E.row takes over the references the
+// new rows hold on their blocks
+void editorSpliceRows(int at, int oldcount, erow *rows, int count) {
+  struct editorUndo *u = editorUndoBegin();
+  editorUndoSave(u, at, oldcount, count);
+  editorRowsOwn();
+
+  int j;
+  for (j = 0; j < count; j++) {
+    erow *row = &rows[j];
+    row->render = NULL;
+    row->rsize = 0;
+    row->wrap = NULL;
+    row->nwrap = 0;
+    // the row takes the place of another one in the file
+    erow *old = j < oldcount ? &E.row[at + j] : NULL;
+    row->dsize = old ? editorRowDiskSize(old) : -1;
+    if (old && row->blk == old->blk && row->chars == old->chars &&
+        row->size == old->size)
+      row->epoch = old->epoch;
+    else
+      row->epoch = E.epoch;
+  }
+  for (j = at; j < at + oldcount; j++) {
+    editorFreeRow(&E.row[j]);
+  }
+  if (count > oldcount)
+    E.row = realloc(E.row, sizeof(erow) * (E.numrows + count - oldcount));
+  if (E.numrows > at + oldcount)
+    memmove(&E.row[at + count], &E.row[at + oldcount],
+            sizeof(erow) * (E.numrows - at - oldcount));
+  if (count)
+    memcpy(&E.row[at], rows, sizeof(erow) * count);
+  E.numrows += count - oldcount;
+  editorRowsChanged(count == oldcount ? E.numrows : at);
+  editorUndoCommit(u);
+
+  if (E.cy > E.numrows)
+    E.cy = E.numrows;
+  if (E.cy < E.numrows && E.cx > E.row[E.cy].size)
+    E.cx = E.row[E.cy].size;
+}
+
+// Replace the rows [from, to) by 'rows', 'count' descriptors of rows of
+// that range. The characters stay where they are, only the descriptors
+// move
+void editorApplyRows(int from, int to, erow *rows, int count) {
+  int j;
+  for (j = 0; j < count; j++) {
+    blockRef(rows[j].blk);
+  }
+  editorSpliceRows(from, to - from, rows, count);
+}
+
+// Order of two rows, bytewise like 'LC_ALL=C sort'
+int rowCompare(const erow *a, const erow *b) {
+  int n = a->size < b->size ? a->size : b->size;
+  int c = memcmp(a->chars, b->chars, n);
+  if (c != 0)
+    return c;
+  return a->size - b->size;
+}
+
+// Merge the sorted runs 'a' and 'b' into 'out', keeping equal rows in
+// their order
+void rowMerge(erow *a, int na, erow *b, int nb, erow *out) {
+  int i = 0, j = 0, k = 0;
+  while (i < na && j < nb) {
+    if (rowCompare(&b[j], &a[i]) < 0)
+      out[k++] = b[j++];
+    else
+      out[k++] = a[i++];
+  }
+  memcpy(&out[k], &a[i], sizeof(erow) * (na - i));
+  k += na - i;
+  memcpy(&out[k], &b[j], sizeof(erow) * (nb - j));
+}
+
+// Stable merge sort of 'n' rows, 'tmp' has room for as many
+void rowSort(erow *rows, erow *tmp, int n) {
+  if (n <= 16) {
+    // insertion sort for short runs
+    int j;
+    for (j = 1; j < n; j++) {
+      erow row = rows[j];
+      int k = j;
+      while (k > 0 && rowCompare(&row, &rows[k - 1]) < 0) {
+        rows[k] = rows[k - 1];
+        k--;
+      }
+      rows[k] = row;
+    }
+    return;
+  }
+  int half = n / 2;
+  rowSort(rows, tmp, half);
+  rowSort(&rows[half], &tmp[half], n - half);
+  // nothing to do for runs already in order, like sorted input
+  if (rowCompare(&rows[half - 1], &rows[half]) <= 0)
+    return;
+  rowMerge(rows, half, &rows[half], n - half, tmp);
+  memcpy(rows, tmp, sizeof(erow) * n);
+}
+
+struct sortJob {
+  erow *rows; // descriptors being sorted
+  erow *tmp;
+  int *start; // merging - run j is rows [start[j], start[j + 1])
+  int runs;
+};
+
+// Worker - sorts the descriptors of its chunk
+void *editorSortChunk(void *arg) {
+  struct rowChunk *chunk = arg;
+  struct sortJob *job = chunk->job;
+  rowSort(&job->rows[chunk->from], &job->tmp[chunk->from],
+          chunk->to - chunk->from);
+  return NULL;
+}
+
+// Rows of 'a' among the first 'k' rows of the stable merge of the sorted
+// runs 'a' and 'b', so that a merge can be split anywhere
+int rowCorank(erow *a, int na, erow *b, int nb, int k) {
+  int lo = k > nb ? k - nb : 0;
+  int hi = k < na ? k : na;
+  while (lo < hi) {
+    int i = lo + (hi - lo) / 2;
+    // equal rows of 'a' go first
+    if (rowCompare(&b[k - i - 1], &a[i]) >= 0)
+      lo = i + 1;
+    else
+      hi = i;
+  }
+  return lo;
+}
+
+// Worker - writes the rows [from, to) of a merge pass into 'tmp'. Every
+// pair of runs is merged by the chunks its output overlaps, so all
+// threads share each pass, the last one included
+void *editorMergeChunk(void *arg) {
+  struct rowChunk *chunk = arg;
+  struct sortJob *job = chunk->job;
+  int j;
+  for (j = 0; j < job->runs; j += 2) {
+    // an odd run out is merged with nothing, that is copied
+    int s = job->start[j];
+    int m = job->start[j + 1];
+    int e = j + 1 < job->runs ? job->start[j + 2] : m;
+    if (e <= chunk->from || s >= chunk->to)
+      continue;
+    int k0 = (chunk->from > s ? chunk->from : s) - s;
+    int k1 = (chunk->to < e ? chunk->to : e) - s;
+    erow *a = &job->rows[s];
+    erow *b = &job->rows[m];
+    int i0 = rowCorank(a, m - s, b, e - m, k0);
+    int i1 = rowCorank(a, m - s, b, e - m, k1);
+    rowMerge(&a[i0], i1 - i0, &b[k0 - i0], (k1 - i1) - (k0 - i0),
+             &job->tmp[s + k0]);
+  }
+  return NULL;
+}
+
+// Sort the rows [from, to): the chunks are sorted on their own threads,
+// then their runs merged pairwise, each pass on all threads too
+void editorSortRows(int from, int to) {
+  int n = to - from;
+  struct sortJob job;
+  job.rows = malloc(sizeof(erow) * (n ? n : 1));
+  job.tmp = malloc(sizeof(erow) * (n ? n : 1));
+  if (n)
+    memcpy(job.rows, &E.row[from], sizeof(erow) * n);
+
+  int numchunks;
+  struct rowChunk *chunks =
+      editorRunChunks(0, n, editorSortChunk, &job, &numchunks);
+  // run j is rows [start[j], start[j + 1])
+  int *start = malloc(sizeof(int) * (numchunks + 1));
+  int j;
+  for (j = 0; j < numchunks; j++) {
+    start[j] = chunks[j].from;
+  }
+  start[numchunks] = n;
+  editorFreeChunks(chunks, numchunks);
+
+  job.start = start;
+  job.runs = numchunks;
+  while (job.runs > 1) {
+    chunks = editorRunChunks(0, n, editorMergeChunk, &job, &numchunks);
+    editorFreeChunks(chunks, numchunks);
+    // the merged runs are in 'tmp', the next pass reads them from there
+    erow *merged = job.tmp;
+    job.tmp = job.rows;
+    job.rows = merged;
+    int k = 0;
+    for (j = 0; j < job.runs; j += 2) {
+      start[k++] = start[j];
+    }
+    start[k] = n;
+    job.runs = k;
+  }
+  free(start);
+  free(job.tmp);
+
+  editorApplyRows(from, to, job.rows, n);
+  free(job.rows);
+}
+
+struct keepJob {
+  int from;      // first row of the range
+  char *pattern; // filter - regex the kept rows match
+  int invert;    // filter - keep the rows that don't match instead
+};
+
+// Worker - keeps the first row of each run of equal rows
+void *editorUniqChunk(void *arg) {
+  struct rowChunk *chunk = arg;
+  struct keepJob *job = chunk->job;
+  int j;
+  for (j = chunk->from; j < chunk->to; j++) {
+    if (j == job->from || rowCompare(&E.row[j], &E.row[j - 1]) != 0)
+      chunkAddRow(chunk, j, NULL);
+  }
+  return NULL;
+}
+
+// Worker - keeps the rows matching the pattern, with its own copy of the
+// regex since the DFA is built while matching
+void *editorFilterChunk(void *arg) {
+  struct rowChunk *chunk = arg;
+  struct keepJob *job = chunk->job;
+  const char *err;
+  regex *re = regexCompile(job->pattern, &err);
+  int j;
+  for (j = chunk->from; j < chunk->to; j++) {
+    erow *row = &E.row[j];
+    if ((regexSearch(re, row->chars, row->size) != -1) != job->invert)
+      chunkAddRow(chunk, j, NULL);
+  }
+  regexFree(re);
+  return NULL;
+}
+
+// Keep the rows of [from, to) that 'fn' picks, returns how many went
+int editorKeepRows(int from, int to, void *(*fn)(void *),
+                   struct keepJob *job) {
+  job->from = from;
+  int numchunks;
+  struct rowChunk *chunks = editorRunChunks(from, to, fn, job, &numchunks);
+  erow *rows = malloc(sizeof(erow) * (to - from ? to - from : 1));
+  int count = 0;
+  int j, k;
+  for (j = 0; j < numchunks; j++) {
+    for (k = 0; k < chunks[j].numrows; k++) {
+      rows[count++] = E.row[chunks[j].index[k]];
+    }
+  }
+  editorFreeChunks(chunks, numchunks);
+  if (count < to - from)
+    editorApplyRows(from, to, rows, count);
+  free(rows);
+  return to - from - count;
+}
+
+/*** clipboard ***/
+// Start and end (exclusive) of the selection between the mark and the
+// cursor, 0 if there is no mark
+int editorSelection(int *sy, int *sx, int *ey, int *ex) {
+  if (!E.markset || E.block)
+    return 0;
+  // the mark may be past the text after edits
+  int my = E.marky < E.numrows ? E.marky : E.numrows;
+  int mx = my < E.numrows ? E.markx : 0;
+  if (my < E.numrows && mx > E.row[my].size)
+    mx = E.row[my].size;
+  if (my < E.cy || (my == E.cy && mx <= E.cx)) {
+    *sy = my;
+    *sx = mx;
+    *ey = E.cy;
+    *ex = E.cx;
+  } else {
+    *sy = E.cy;
+    *sx = E.cx;
+    *ey = my;
+    *ex = mx;
+  }
+  return 1;
+}
+
+// Row made of the three pieces back to back, in a block of its own
+erow rowConcat(const char *a, int alen, const char *b, int blen,
+               const char *c, int clen) {
+  erow row;
+  row.size = alen + blen + clen;
+  row.blk = blockNew(row.size);
+  row.chars = blockData(row.blk);
+  memcpy(row.chars, a, alen);
+  memcpy(&row.chars[alen], b, blen);
+  memcpy(&row.chars[alen + blen], c, clen);
+  row.chars[row.size] = '\0';
+  return row;
+}
+
+void editorClipClear() {
+  int j;
+  for (j = 0; j < E.numclip; j++) {
+    blockUnref(E.clip[j].blk);
+  }
+  free(E.clip);
+  E.clip = NULL;
+  E.numclip = 0;
 }
 
-// Insert a New Line
-void editorInsertNewLine() {
-  // Insert an Empty line if at the beginning of the Line
-  if (E.cx == 0) {
-    editorInsertRow(E.cy, "", 0);
+// Put the selection on the clipboard. Each line is a slice of its row
+// holding a reference on the block, the characters aren't copied: the
+// row gets a copy of its own if it is edited later
+int editorCopy() {
+  int sy, sx, ey, ex;
+  if (!editorSelection(&sy, &sx, &ey, &ex)) {
+    editorSetStatusMessage("No selection, set the mark with Ctrl-Space");
+    return 0;
   }
-  // Spilting the Row at cursor's x (E.cx) into two Rows
-  else {
-    erow *row = &E.row[E.cy];
-    // Inserting a new row after E.cy with contents to right of E.cx
-    editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-    // Getting the Current Row Pointer
-    row = &E.row[E.cy];
-    // Resetting the Size of Current Row
-    row->size = E.cx;
-    // Adding NULL to the end
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
+  editorClipClear();
+  E.numclip = ey - sy + 1;
+  E.clip = malloc(sizeof(erow) * E.numclip);
+  int y;
+  for (y = sy; y <= ey; y++) {
+    erow *slice = &E.clip[y - sy];
+    if (y == E.numrows) {
+      // the selection ends on the line past the text
+      *slice = rowConcat("", 0, "", 0, "", 0);
+      continue;
+    }
+    erow *row = &E.row[y];
+    int from = y == sy ? sx : 0;
+    int to = y == ey ? ex : row->size;
+    slice->blk = row->blk;
+    blockRef(slice->blk);
+    slice->chars = &row->chars[from];
+    slice->size = to - from;
   }
-  // Moving to the Start of the Inserted Line
-  E.cy++;
-  E.cx = 0;
+  E.markset = 0;
+  editorSetStatusMessage("Copied %d lines", E.numclip);
+  return 1;
 }
 
-void editorDelChar() {
-  // nothing to delete at EOF
-  if (E.cy == E.numrows) {
+// Copy the selection and remove it from the text as one change
+void editorCut() {
+  int sy, sx, ey, ex;
+  if (!editorSelection(&sy, &sx, &ey, &ex) || (sy == ey && sx == ex)) {
+    editorSetStatusMessage("Nothing to cut");
     return;
   }
-  // nothing to delete if the cursor is at the beginning of the line
-  if (E.cx == 0 && E.cy == 0) {
+  editorCopy();
+  // the text before the selection joins the text after it
+  erow *first = &E.row[sy];
+  erow row;
+  if (ey < E.numrows)
+    row = rowConcat(first->chars, sx, &E.row[ey].chars[ex],
+                    E.row[ey].size - ex, "", 0);
+  else
+    row = rowConcat(first->chars, sx, "", 0, "", 0);
+  int oldcount = (ey < E.numrows ? ey + 1 : E.numrows) - sy;
+  editorSpliceRows(sy, oldcount, &row, 1);
+  E.cy = sy;
+  E.cx = sx;
+  editorSetStatusMessage("Cut %d lines", E.numclip);
+}
+
+// Insert the clipboard at the cursor. The lines in the middle go into
+// E.row as they are, only the first and last are joined with the text
+// around the cursor
+void editorPaste() {
+  if (E.numclip == 0) {
+    editorSetStatusMessage("Clipboard is empty");
     return;
   }
-
-  // getting the current row
-  erow *row = &E.row[E.cy];
-  // get the row the cursor is on
-  // and if there is character left to cursor delete it
-  if (E.cx > 0) {
-    editorRowDelChar(row, E.cx - 1);
-    E.cx--;
+  int n = E.numclip;
+  erow *rows = malloc(sizeof(erow) * n);
+  char *line = "";
+  int size = 0;
+  if (E.cy < E.numrows) {
+    line = E.row[E.cy].chars;
+    size = E.row[E.cy].size;
+  }
+  erow *clip = E.clip;
+  if (n == 1) {
+    rows[0] = rowConcat(line, E.cx, clip[0].chars, clip[0].size,
+                        &line[E.cx], size - E.cx);
   } else {
-    // Set Cursor's col to above line's end
-    E.cx = E.row[E.cy - 1].size;
-    // appending the current row's chars to the end of previous row
-    editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-    editorDelRow(E.cy);
-    // Set Cursor's row to above row
-    E.cy--;
+    rows[0] = rowConcat(line, E.cx, clip[0].chars, clip[0].size, "", 0);
+    int j;
+    for (j = 1; j < n - 1; j++) {
+      rows[j] = clip[j];
+      blockRef(rows[j].blk);
+    }
+    rows[n - 1] = rowConcat("", 0, clip[n - 1].chars, clip[n - 1].size,
+                            &line[E.cx], size - E.cx);
   }
+  int cy = E.cy;
+  int cx = (n == 1 ? E.cx : 0) + clip[n - 1].size;
+  editorSpliceRows(E.cy, E.cy < E.numrows ? 1 : 0, rows, n);
+  free(rows);
+  // the cursor goes after the pasted text
+  E.cy = cy + n - 1;
+  E.cx = cx;
+  editorSetStatusMessage("Pasted %d lines", n);
 }
 
-/*** file i/o ***/
-// Converting the erow struct array to string that can be written
-// to a file
-char *editorRowsToString(int *buflen) {
-  // total length of the Buffer - Sum of all chars of erow
-  int totlen = 0;
+/*** block editing ***/
+// Rows and render columns of the rectangle between the mark and the
+// cursor, 0 if the mark isn't a block mark. When 'left' == 'right' the
+// block is a column of width zero that typing inserts into
+int editorBlock(int *sy, int *ey, int *left, int *right) {
+  if (!E.markset || !E.block)
+    return 0;
+  int my = E.marky < E.numrows ? E.marky : E.numrows;
+  *sy = my < E.cy ? my : E.cy;
+  *ey = my < E.cy ? E.cy : my;
+  // the line past the text has nothing to edit
+  if (*ey >= E.numrows)
+    *ey = E.numrows - 1;
+  *left = E.markx < E.blockx ? E.markx : E.blockx;
+  *right = E.markx < E.blockx ? E.blockx : E.markx;
+  return 1;
+}
+
+struct blockJob {
+  int left, right; // render columns replaced on every row
+  char *text;      // what they are replaced with
+  int len;
+};
 
-  // adding 1 to each erow for '\n'
+// Worker - builds the rows of the chunk with the columns of the block
+// replaced, rows that end before the block are left alone
+void *editorBlockChunk(void *arg) {
+  struct rowChunk *chunk = arg;
+  struct blockJob *job = chunk->job;
   int j;
-  for (j = 0; j < E.numrows; j++) {
-    totlen += E.row[j].size + 1;
+  for (j = chunk->from; j < chunk->to; j++) {
+    erow *row = &E.row[j];
+    int from = editorRowRxtoCx(row, job->left);
+    if (from == row->size && editorRowCxToRx(row, row->size) < job->left)
+      continue;
+    int to = editorRowRxtoCx(row, job->right);
+    if (from == to && job->len == 0)
+      continue;
+    erow new = rowConcat(row->chars, from, job->text, job->len,
+                         &row->chars[to], row->size - to);
+    chunkAddRow(chunk, j, &new);
   }
-  *buflen = totlen;
-
-  // allocating the memory for the whole buffer
-  char *buf = malloc(totlen);
-  // looping through each row and adding '\n' to each row
-  // and copying each row to the end of the buffer - 'buf'
-  // (using *p as a temp pointer)
-  char *p = buf;
-  for (j = 0; j < E.numrows; j++) {
-    // copying j-th row chars to pointer 'p' (our temp buffer)
-    memcpy(p, E.row[j].chars, E.row[j].size);
-    // offseting the pointer to end of the copied characters
-    p += E.row[j].size;
-    // writing new line at the end
-    *p = '\n';
-    p++;
-  }
-  // returning the buffer
-  return buf;
+  return NULL;
 }
 
-void editorOpen(char *filename) {
-  // Storing File Name in editor config
-  free(E.filename);
-  E.filename = strdup(filename);
-
-  FILE *fp = fopen(filename, "r");
-  if (!fp)
-    die("fopen");
+// Replace the columns [left, right) of the rows [sy, ey] by 'text' as one
+// change, leaving the block as a column of width zero after the text.
+// Returns the number of rows changed
+int editorBlockReplace(int sy, int ey, int left, int right, char *text,
+                       int len) {
+  if (ey < sy)
+    return 0;
+  struct blockJob job = {left, right, text, len};
+  int numchunks;
+  struct rowChunk *chunks =
+      editorRunChunks(sy, ey + 1, editorBlockChunk, &job, &numchunks);
 
-  char *line = NULL;
-  size_t linecap = 0;
-  ssize_t linelen;
-  // Reading the File Line-by-Line and Appending Each line as erow
-  // to E.row array
-  while ((linelen = getline(&line, &linecap, fp)) != -1) {
-    while (linelen > 0 &&
-           (line[linelen - 1] == '\n' || line[linelen - 1] == '\r')) {
-      linelen--;
+  // the rows are recorded as one piece, undo keeps the render of those
+  // that didn't change
+  struct editorUndo *u = editorUndoBegin();
+  editorUndoSave(u, sy, ey - sy + 1, ey - sy + 1);
+  editorRowsOwn();
+  int rows = 0;
+  int j, k;
+  for (j = 0; j < numchunks; j++) {
+    for (k = 0; k < chunks[j].numrows; k++) {
+      erow *row = &E.row[chunks[j].index[k]];
+      erow *new = &chunks[j].rows[k];
+      new->render = NULL;
+      new->rsize = 0;
+      new->wrap = NULL;
+      new->nwrap = 0;
+      new->dsize = editorRowDiskSize(row);
+      editorFreeRow(row);
+      *row = *new;
+      editorRowChanged(row);
     }
-    editorInsertRow(E.numrows, line, linelen);
+    rows += chunks[j].numrows;
   }
-  free(line);
-  fclose(fp);
-  E.dirty = 0;
+  editorFreeChunks(chunks, numchunks);
+  if (rows == 0) {
+    editorUndoFree(u);
+    return 0;
+  }
+  editorUndoCommit(u);
+
+  // a tab takes more than one column
+  E.markx = left;
+  for (j = 0; j < len; j++) {
+    E.markx = renderNext(text[j], E.markx);
+  }
+  E.blockx = E.markx;
+  if (E.cy < E.numrows)
+    E.cx = editorRowRxtoCx(&E.row[E.cy], E.markx);
+  return rows;
 }
 
-void editorSave() {
-  if (E.filename == NULL) {
-    E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
-    if (E.filename == NULL) {
-      editorSetStatusMessage("Save aborted");
-      return;
-    }
+// Apply a key typed in block mode to every row of the block: a character
+// replaces the block, or is inserted if it has no width, and Backspace
+// and Delete remove the block or the column before or after it
+void editorBlockKey(int c) {
+  int sy, ey, left, right;
+  editorBlock(&sy, &ey, &left, &right);
+  char ch = c;
+  if (c == BACKSPACE || c == CTRL_KEY('h')) {
+    if (left == right && left > 0)
+      left--;
+    editorBlockReplace(sy, ey, left, right, "", 0);
+  } else if (c == DEL_KEY) {
+    if (left == right)
+      right++;
+    editorBlockReplace(sy, ey, left, right, "", 0);
+  } else {
+    editorBlockReplace(sy, ey, left, right, &ch, 1);
   }
+}
 
-  // getting the buffer and it's length
-  int len;
-  char *buf = editorRowsToString(&len);
-
-  // opening file
-  int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-  if (fd != -1) {
-    // setting the file size to the buffer length
-    if (ftruncate(fd, len) != -1) {
-      // writing the buffer to the file
-      if (write(fd, buf, len) != -1) {
-        // closing the file
-        close(fd);
-        // freeing the allocated memory
-        free(buf);
-        // Resetting Dirty buffer
-        E.dirty = 0;
-        // Setting the Status that the file is saved
-        editorSetStatusMessage("%d bytes written to disk", len);
-        return;
-      }
-    }
-    close(fd);
+// Put the columns of the block on the clipboard, one line per row, and
+// remove them from the text if 'cut'
+void editorBlockCopy(int cut) {
+  int sy, ey, left, right;
+  editorBlock(&sy, &ey, &left, &right);
+  if (ey < sy || left == right) {
+    editorSetStatusMessage(cut ? "Nothing to cut" : "Nothing to copy");
+    return;
+  }
+  editorClipClear();
+  E.numclip = ey - sy + 1;
+  E.clip = malloc(sizeof(erow) * E.numclip);
+  int y;
+  for (y = sy; y <= ey; y++) {
+    erow *row = &E.row[y];
+    erow *slice = &E.clip[y - sy];
+    int from = editorRowRxtoCx(row, left);
+    slice->blk = row->blk;
+    blockRef(slice->blk);
+    slice->chars = &row->chars[from];
+    slice->size = editorRowRxtoCx(row, right) - from;
   }
-  free(buf);
-  // Setting the Status that the file didn't save correctly
-  editorSetStatusMessage("Can't save ! I/O error : %s", strerror(errno));
+  if (cut)
+    editorBlockReplace(sy, ey, left, right, "", 0);
+  E.markset = 0;
+  E.block = 0;
+  editorSetStatusMessage("%s %d lines", cut ? "Cut" : "Copied", E.numclip);
 }
 
-/*** find ***/
-void editorFindCallback(char *query, int key) {
-  // For moving forward and backward between multiple search occurences
-  // *static variables are only initialised once*
-  static int last_match = -1; // index of the last matched row
-  static int direction = 1; // direction of search 1 -> Forward  -1 -> Backward
+/*** commands ***/
+// Human readable byte count, like 1.5M
+char *formatBytes(char *buf, size_t bufsize, long long n) {
+  const char *units = "BKMGT";
+  double v = n;
+  while (v >= 1024 && units[1]) {
+    v /= 1024;
+    units++;
+  }
+  if (*units == 'B')
+    snprintf(buf, bufsize, "%lldB", n);
+  else
+    snprintf(buf, bufsize, "%.1f%c", v, *units);
+  return buf;
+}
 
-  if (key == '\r' || key == '\x1b') {
-    last_match = -1;
-    direction = 1;
+// Report the memory held by the rows
+void editorCommandStats(char *args) {
+  (void)args;
+  long long chars = 0;
+  int rendered = 0;
+  int j;
+  for (j = 0; j < E.numrows; j++) {
+    chars += sizeof(tblock) + E.row[j].size + 1;
+    if (E.row[j].render)
+      rendered++;
+  }
+  char c[16], r[16], b[16], a[16];
+  editorSetStatusMessage(
+      "chars %s | render %s (%d rows, budget %s) | E.row %s",
+      formatBytes(c, sizeof(c), chars),
+      formatBytes(r, sizeof(r), E.renderbytes), rendered,
+      formatBytes(b, sizeof(b), E.budget),
+      formatBytes(a, sizeof(a), (long long)sizeof(erow) * E.numrows));
+}
+
+// Set the bytes render buffers may take, with an optional K, M or G
+void editorCommandBudget(char *args) {
+  char *end;
+  long long n = strtoll(args, &end, 10);
+  int shift = 0;
+  if (*end == 'K' || *end == 'k')
+    shift = 10;
+  else if (*end == 'M' || *end == 'm')
+    shift = 20;
+  else if (*end == 'G' || *end == 'g')
+    shift = 30;
+  if (shift)
+    end++;
+  if (end == args || *end != '\0' || n < 0) {
+    char b[16];
+    editorSetStatusMessage("Render budget is %s",
+                           formatBytes(b, sizeof(b), E.budget));
     return;
   }
-  // Setting the Direction Based on Arrow Keys
-  else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
-    direction = 1;
-  } else if (key == ARROW_LEFT || key == ARROW_UP) {
-    direction = -1;
-  } else {
-    last_match = -1;
-    direction = 1;
+  E.budget = n << shift;
+  E.renderkept = 0;
+  editorEvictRenders();
+  char b[16];
+  editorSetStatusMessage("Render budget set to %s",
+                         formatBytes(b, sizeof(b), E.budget));
+}
+
+// Rows a command works on: an optional leading 'N,M' line range, the
+// whole buffer otherwise. Moves *args past it, returns 0 if invalid
+int editorCommandRange(char **args, int *from, int *to) {
+  *from = 0;
+  *to = E.numrows;
+  if (!isdigit((unsigned char)**args))
+    return 1;
+  char *end;
+  long first = strtol(*args, &end, 10);
+  if (*end != ',')
+    return 0;
+  char *p = end + 1;
+  long last = strtol(p, &end, 10);
+  if (end == p || (*end != ' ' && *end != '\0') || first < 1 || last < first)
+    return 0;
+  *from = first - 1 < E.numrows ? first - 1 : E.numrows;
+  *to = last < E.numrows ? last : E.numrows;
+  while (*end == ' ')
+    end++;
+  *args = end;
+  return 1;
+}
+
+// Sort the lines bytewise
+void editorCommandSort(char *args) {
+  int from, to;
+  if (!editorCommandRange(&args, &from, &to) || *args) {
+    editorSetStatusMessage("Usage: sort [N,M]");
+    return;
   }
+  editorSortRows(from, to);
+  editorSetStatusMessage("Sorted %d lines", to - from);
+}
 
-  if (last_match == -1) {
-    direction = 1;
+// Drop lines equal to the one before them
+void editorCommandUniq(char *args) {
+  int from, to;
+  if (!editorCommandRange(&args, &from, &to) || *args) {
+    editorSetStatusMessage("Usage: uniq [N,M]");
+    return;
   }
-  // index of the row we are searching
-  int current = last_match;
+  struct keepJob job = {0, NULL, 0};
+  int removed = editorKeepRows(from, to, editorUniqChunk, &job);
+  editorSetStatusMessage("Removed %d duplicate lines", removed);
+}
 
-  // looping through each erow till end or
-  // we find a match
-  int i;
-  for (i = 0; i < E.numrows; i++) {
-    // incrementing the current value in 'direction' 
-    // till we find the next occurence of query
-    current += direction;
-    // To Wrap the whole file
-    if (current == -1) {
-      current = E.numrows - 1;
-    } else if (current == E.numrows) {
-      current = 0;
-    }
-    // current erow
-    erow *row = &E.row[current];
-    // fining the match
-    char *match = strstr(row->render, query);
-    // if we found a match we move the Cursor Position to the match posiionn
-    if (match) {
-      // saving the current row as the last_matched value row index
-      last_match = current;
-      E.cy = current;
-      // setting cursor 'x' to be the Offset to match pointer position
-      E.cx = editorRowRxtoCx(row, match - row->render);
-      // Setting rowOff to EOF makes E.rowOff = E.cy in editorScroll
-      E.rowoff = E.numrows;
-      break;
-    }
+// Keep the lines matching a regex, or with '!' those that don't
+void editorCommandFilter(char *args) {
+  int from, to;
+  if (!editorCommandRange(&args, &from, &to) || *args == '\0') {
+    editorSetStatusMessage("Usage: filter [N,M] [!]regex");
+    return;
+  }
+  struct keepJob job = {0, args, 0};
+  if (*args == '!') {
+    job.invert = 1;
+    job.pattern++;
+  }
+  const char *err;
+  regex *re = regexCompile(job.pattern, &err);
+  if (re == NULL) {
+    editorSetStatusMessage("Invalid regex: %s", err);
+    return;
   }
+  regexFree(re);
+  int removed = editorKeepRows(from, to, editorFilterChunk, &job);
+  editorSetStatusMessage("Removed %d lines", removed);
 }
 
-void editorFind() {
-  // saving the current cursor position
-  int saved_cx = E.cx;
-  int saved_cy = E.cy;
-  int saved_coloff = E.coloff;
-  int saved_rowoff = E.rowoff;
+// Toggle soft wrapping of long lines
+void editorCommandWrap(char *args) {
+  (void)args;
+  E.wrap = !E.wrap;
+  // the view starts at the same row
+  E.wraprowoff = -1;
+  E.frame.numlines = 0;
+  editorSetStatusMessage("Soft wrap %s", E.wrap ? "on" : "off");
+}
 
-  // getting the query from User
-  // passing editorFindCallback function as a Callback Fucntion for
-  // Incremental Search
-  char *query =
-      editorPrompt("Search : %s (Use ESC/Arrows/Enter)", editorFindCallback);
-  if (query) {
-    free(query);
-  } else {
-    // Restoring the Cursor Position
-    E.cx = saved_cx;
-    E.cy = saved_cy;
-    E.coloff = saved_coloff;
-    E.rowoff = saved_rowoff;
+// Commands of the Ctrl-P prompt, run with the text after their name
+struct editorCommand {
+  const char *name;
+  void (*run)(char *args);
+  int edits; // changes the rows, has to wait for the file to load
+};
+
+struct editorCommand commands[] = {
+    {"stats", editorCommandStats, 0},
+    {"budget", editorCommandBudget, 0},
+    {"sort", editorCommandSort, 1},
+    {"uniq", editorCommandUniq, 1},
+    {"filter", editorCommandFilter, 1},
+    {"wrap", editorCommandWrap, 0},
+};
+
+// Ask for a command and run it
+void editorCommand() {
+  char *line = editorPrompt("Command : %s (ESC to cancel)", NULL, 0);
+  if (line == NULL)
+    return;
+
+  char *name = line;
+  while (*name == ' ')
+    name++;
+  size_t len = strcspn(name, " ");
+  char *args = &name[len];
+  while (*args == ' ')
+    args++;
+
+  unsigned int j;
+  for (j = 0; j < sizeof(commands) / sizeof(commands[0]); j++) {
+    if (strlen(commands[j].name) == len &&
+        strncmp(commands[j].name, name, len) == 0) {
+      if (commands[j].edits && E.load.fd != -1)
+        editorSetStatusMessage("Still loading, %s has to wait", name);
+      else
+        commands[j].run(args);
+      free(line);
+      return;
+    }
   }
+  editorSetStatusMessage("Unknown command: %s", name);
+  free(line);
 }
 
 /*** append buffer ***/
@@ -661,6 +3479,9 @@ struct abuf {
 
 // append a string 's' to append-buffer 'abuf'
 void abAppend(struct abuf *ab, const char *s, int len) {
+  // nothing to add - realloc() of 0 bytes would free the buffer
+  if (len == 0)
+    return;
   // allocate memory to hold the new string
   char *new = realloc(ab->b, ab->len + len);
 
@@ -679,7 +3500,10 @@ void abFree(struct abuf *ab) { free(ab->b); }
 
 /*** input ***/
 // Editor prompt
-char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
+// Read a line in the message bar, NULL if cancelled. Enter on an empty
+// line is ignored unless 'allowempty'
+char *editorPrompt(char *prompt, void (*callback)(char *, int),
+                   int allowempty) {
   size_t bufsize = 128;
   // user input
   char *buf = malloc(bufsize);
@@ -712,7 +3536,7 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
     }
     // if user presses ENTER and the buflen is not zero return it - filename
     else if (c == '\r') {
-      if (buflen != 0) {
+      if (buflen != 0 || allowempty) {
         editorSetStatusMessage("");
         if (callback) {
           callback(buf, c);
@@ -786,16 +3610,59 @@ void editorMoveCursor(int key) {
   }
 }
 // Handle the KeyPress
+// Whether the key changes the text (or saves it)
+int editorKeyEdits(int c) {
+  switch (c) {
+  case ARROW_UP:
+  case ARROW_DOWN:
+  case ARROW_LEFT:
+  case ARROW_RIGHT:
+  case PAGE_UP:
+  case PAGE_DOWN:
+  case HOME_KEY:
+  case END_KEY:
+  case CTRL_KEY('q'):
+  case CTRL_KEY('f'):
+  case CTRL_KEY('r'):
+  case CTRL_KEY('g'):
+  case CTRL_KEY('p'):
+  case CTRL_KEY('@'):
+  case CTRL_KEY('b'):
+  case CTRL_KEY('c'):
+  case CTRL_KEY('l'):
+  case '\x1b':
+    return 0;
+  }
+  return 1;
+}
+
 void editorProcessKeypresses() {
   static int quit_times = TEXT_QUIT_TIMES;
 
   int c = editorReadKey();
 
+  // rows are only appended to while the file loads
+  if (E.load.fd != -1 && editorKeyEdits(c)) {
+    editorSetStatusMessage("Still loading, edits have to wait");
+    return;
+  }
+
+  // in block mode typing edits all the rows of the block at once
+  if (E.markset && E.block &&
+      ((c >= ' ' && c < 127) || c == '\t' || c == BACKSPACE ||
+       c == CTRL_KEY('h') || c == DEL_KEY)) {
+    editorBlockKey(c);
+    quit_times = TEXT_QUIT_TIMES;
+    return;
+  }
+
   switch (c) {
   case '\r':
     editorInsertNewLine();
     break;
   case CTRL_KEY('q'):
+    // the outcome of a running save decides if the file is still dirty
+    editorWaitSave();
     if (E.dirty && quit_times > 0) {
       editorSetStatusMessage("WARNING!! File has unsaved changes. "
                              "Press Ctrl-Q %d more times to quit.",
@@ -820,7 +3687,55 @@ void editorProcessKeypresses() {
     }
     break;
   case CTRL_KEY('f'):
-    editorFind();
+    editorFind(0);
+    break;
+  case CTRL_KEY('r'):
+    editorFind(1);
+    break;
+  case CTRL_KEY('t'):
+    editorReplaceAll();
+    break;
+  case CTRL_KEY('z'):
+    editorUndo();
+    break;
+  case CTRL_KEY('g'):
+    editorGoto();
+    break;
+  case CTRL_KEY('p'):
+    editorCommand();
+    break;
+  case CTRL_KEY('@'):
+    // Ctrl-Space
+    E.markset = !E.markset;
+    E.block = 0;
+    E.markx = E.cx;
+    E.marky = E.cy;
+    editorSetStatusMessage(E.markset ? "Mark set" : "Mark cleared");
+    break;
+  case CTRL_KEY('b'):
+    // the mark of a block is a screen column, so that it stays put on
+    // rows with tabs
+    E.block = !(E.markset && E.block);
+    E.markset = E.block;
+    E.markx = E.cy < E.numrows ? editorRowCxToRx(&E.row[E.cy], E.cx) : 0;
+    E.blockx = E.markx;
+    E.marky = E.cy;
+    editorSetStatusMessage(E.block ? "Block mark set" : "Block cleared");
+    break;
+  case CTRL_KEY('c'):
+    if (E.block)
+      editorBlockCopy(0);
+    else
+      editorCopy();
+    break;
+  case CTRL_KEY('x'):
+    if (E.block)
+      editorBlockCopy(1);
+    else
+      editorCut();
+    break;
+  case CTRL_KEY('v'):
+    editorPaste();
     break;
   case BACKSPACE:
   case CTRL_KEY('h'):
@@ -836,6 +3751,12 @@ void editorProcessKeypresses() {
     // Scroll within Page
     if (c == PAGE_UP) {
       E.cy = E.rowoff;
+    } else if (c == PAGE_DOWN && E.wrap) {
+      // the row on the last screen line
+      E.cy = fenwickSearch(editorVlines(), E.voff + E.screenrows - 1);
+      if (E.cy > E.numrows) {
+        E.cy = E.numrows;
+      }
     } else if (c == PAGE_DOWN) {
       E.cy = E.rowoff + E.screenrows - 1;
       if (E.cy > E.numrows) {
@@ -858,12 +3779,58 @@ void editorProcessKeypresses() {
     break;
   }
 
+  // moving up and down keeps the column of the block
+  if (E.markset && E.block && E.cy < E.numrows) {
+    if (c == ARROW_UP || c == ARROW_DOWN || c == PAGE_UP || c == PAGE_DOWN)
+      E.cx = editorRowRxtoCx(&E.row[E.cy], E.blockx);
+    else if (c != CTRL_KEY('b'))
+      E.blockx = editorRowCxToRx(&E.row[E.cy], E.cx);
+  }
+
   // Restting Quit Times if any other key then Ctrl-Q is pressed
   quit_times = TEXT_QUIT_TIMES;
 }
 
 /*** output ***/
 // For Scrolling
+// Screen line of the cursor in soft wrap mode, with its column on it
+long long editorCursorLine(int *col) {
+  struct fenwick *f = editorVlines();
+  *col = E.rx;
+  if (E.cy >= E.numrows)
+    return fenwickPrefix(f, E.numrows);
+  erow *row = &E.row[E.cy];
+  int n = editorRowWrap(row);
+  int seg = 0;
+  while (seg + 1 < n && row->wrap[seg] <= E.rx)
+    seg++;
+  if (seg > 0)
+    *col -= row->wrap[seg - 1];
+  // the end of a full line stays on it
+  if (*col >= E.screencols)
+    *col = E.screencols - 1;
+  return fenwickPrefix(f, E.cy) + seg;
+}
+
+// Scrolling by screen lines in soft wrap mode. E.rowoff follows as the
+// row at the top, when something else moved it the view starts there
+void editorScrollWrapped() {
+  struct fenwick *f = editorVlines();
+  if (E.rowoff != E.wraprowoff) {
+    int top = E.rowoff < E.numrows ? E.rowoff : E.numrows;
+    E.voff = fenwickPrefix(f, top);
+  }
+  int col;
+  long long line = editorCursorLine(&col);
+  if (line < E.voff)
+    E.voff = line;
+  if (line >= E.voff + E.screenrows)
+    E.voff = line - E.screenrows + 1;
+  E.rowoff = fenwickSearch(f, E.voff);
+  E.wraprowoff = E.rowoff;
+  E.coloff = 0;
+}
+
 void editorScroll() {
   E.rx = 0;
   if (E.cy < E.numrows) {
@@ -881,13 +3848,24 @@ void editorScroll() {
   if (E.rx >= E.coloff + E.screencols) {
     E.coloff = E.rx - E.screencols + 1;
   }
+  if (E.wrap)
+    editorScrollWrapped();
 }
 //
-// Add Rows to Standard Output
-void editorDrawRows(struct abuf *ab) {
+// Add Rows to the frame, screen row 'y' starts at ab->b[start[y]]
+void editorDrawRows(struct abuf *ab, int *start) {
+  int sy, sx, ey, ex;
+  int selection = editorSelection(&sy, &sx, &ey, &ex);
+  int by, bey, left, right;
+  int block = editorBlock(&by, &bey, &left, &right);
+  int filerow = E.rowoff;
+  // soft wrap - screen line of 'filerow' the next screen row shows
+  int seg = 0;
+  if (E.wrap && E.rowoff < E.numrows)
+    seg = E.voff - fenwickPrefix(editorVlines(), E.rowoff);
   int y;
   for (y = 0; y < E.screenrows; y++) {
-    int filerow = y + E.rowoff;
+    start[y] = ab->len;
     if (filerow >= E.numrows) {
       // Show the Welcome Message - Only show when open without a file
       if (E.numrows == 0 && y == E.screenrows / 3) {
@@ -909,16 +3887,51 @@ void editorDrawRows(struct abuf *ab) {
         abAppend(ab, "~", 1);
       }
     } else {
-      int len = E.row[filerow].rsize - E.coloff;
+      erow *row = &E.row[filerow];
+      char *render = editorRowRender(row);
+      int from = E.coloff;
+      int len = row->rsize - E.coloff;
+      if (E.wrap) {
+        int n = editorRowWrap(row);
+        from = seg > 0 ? row->wrap[seg - 1] : 0;
+        len = (seg + 1 < n ? row->wrap[seg] : row->rsize) - from;
+        if (++seg == n) {
+          seg = 0;
+          filerow++;
+        }
+      } else {
+        filerow++;
+      }
       if (len < 0)
         len = 0;
       if (len > E.screencols)
         len = E.screencols;
-      abAppend(ab, &E.row[filerow].render[E.coloff], len);
+      // the selected part in reverse video
+      int hs = from, he = from;
+      if (selection && row - E.row >= sy && row - E.row <= ey) {
+        hs = row - E.row == sy ? editorRowCxToRx(row, sx) : 0;
+        he = row - E.row == ey ? editorRowCxToRx(row, ex) : row->rsize;
+      } else if (block && row - E.row >= by && row - E.row <= bey) {
+        // a block of width zero still shows where typing goes
+        hs = left;
+        he = left == right ? left + 1 : right;
+      }
+      if (hs < from)
+        hs = from;
+      if (hs > from + len)
+        hs = from + len;
+      if (he > from + len)
+        he = from + len;
+      if (he < hs)
+        he = hs;
+      abAppend(ab, &render[from], hs - from);
+      if (he > hs) {
+        abAppend(ab, "\x1b[7m", 4);
+        abAppend(ab, &render[hs], he - hs);
+        abAppend(ab, "\x1b[m", 3);
+      }
+      abAppend(ab, &render[he], from + len - he);
     }
-    // EraseCurrent Line -[0k => 0 to erase part of line after the cursor
-    abAppend(ab, "\x1b[K", 3);
-    abAppend(ab, "\r\n", 2);
   }
 }
 
@@ -930,11 +3943,22 @@ void editorDrawStatusBar(struct abuf *ab) {
 
   // Creating the Status Text and finding it's length
   char status[80], rstatus[80];
+  char state[32] = "";
+  if (E.load.fd != -1 && E.load.total > 0) {
+    snprintf(state, sizeof(state), "(loading %d%%)",
+             (int)(E.load.bytes * 100 / E.load.total));
+  } else if (E.load.fd != -1) {
+    char b[16];
+    snprintf(state, sizeof(state), "(loading %s)",
+             formatBytes(b, sizeof(b), E.load.bytes));
+  } else if (E.dirty) {
+    strcpy(state, "(modified)");
+  }
   int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
-                     E.filename ? E.filename : "[No Name]", E.numrows,
-                     E.dirty ? "(modified)" : "");
-  // right status
-  int rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d", E.cy + 1, E.numrows);
+                     E.filename ? E.filename : "[No Name]", E.numrows, state);
+  // right status - line and byte offset of the cursor
+  int rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d @%lld", E.cy + 1,
+                      E.numrows, editorByteOffset(E.cy, E.cx));
 
   if (len > E.screencols)
     len = E.screencols;
@@ -954,13 +3978,10 @@ void editorDrawStatusBar(struct abuf *ab) {
 
   // Resting Inverted Colors
   abAppend(ab, "\x1b[m", 3);
-  abAppend(ab, "\r\n", 2);
 }
 
 // Draw Message Bar
 void editorDrawMessageBar(struct abuf *ab) {
-  // Clearing the text after cursor
-  abAppend(ab, "\x1b[K", 3);
   // Appending the Message
   int msglen = strlen(E.statusmsg);
   if (msglen > E.screencols) {
@@ -986,33 +4007,91 @@ void editorRefreshScreen() {
 
   // for Scrolling
   editorScroll();
+  editorEvictRenders();
 
-  struct abuf ab = ABUF_INIT;
+  // Drawing the frame - rows, status bar and message bar, one line each
+  int numlines = E.screenrows + 2;
+  int *start = malloc(sizeof(int) * (numlines + 1));
+  struct abuf frame = ABUF_INIT;
+  editorDrawRows(&frame, start);
+  start[E.screenrows] = frame.len;
+  editorDrawStatusBar(&frame);
+  start[E.screenrows + 1] = frame.len;
+  editorDrawMessageBar(&frame);
+  start[numlines] = frame.len;
 
+  struct abuf ab = ABUF_INIT;
+  char buf[32];
+  // Synchronized update - the terminal shows the whole frame at once
+  abAppend(&ab, "\x1b[?2026h", 8);
   // Hide Cursor
   abAppend(&ab, "\x1b[?25l", 6);
-  // Repositioning the Cursor
-  abAppend(&ab, "\x1b[H", 3);
 
-  // Drawing Rows
-  editorDrawRows(&ab);
-  // Drawing Status Bar
-  editorDrawStatusBar(&ab);
-  // Drawing Message Bar
-  editorDrawMessageBar(&ab);
+  // When the view moved by less than a screen the terminal scrolls the
+  // rows it already shows: <esc>[{top};{bottom}r limits scrolling to the
+  // text rows, <esc>[{n}S / <esc>[{n}T scroll up / down, <esc>[r resets
+  int valid = E.frame.numlines == numlines;
+  long long top = E.wrap ? E.voff : E.rowoff;
+  long long shift = valid ? top - E.frame.rowoff : 0;
+  if (shift != 0 && llabs(shift) < E.screenrows) {
+    snprintf(buf, sizeof(buf), "\x1b[1;%dr\x1b[%lld%c\x1b[r", E.screenrows,
+             llabs(shift), shift > 0 ? 'S' : 'T');
+    abAppend(&ab, buf, strlen(buf));
+  } else {
+    shift = 0;
+  }
+
+  // Sending only the lines that differ from what is on the screen
+  int y;
+  for (y = 0; y < numlines; y++) {
+    char *line = &frame.b[start[y]];
+    int len = start[y + 1] - start[y];
+    if (valid) {
+      int old = y < E.screenrows ? y + shift : y;
+      if (y >= E.screenrows || (old >= 0 && old < E.screenrows)) {
+        int oldlen = E.frame.start[old + 1] - E.frame.start[old];
+        if (oldlen == len &&
+            memcmp(line, &E.frame.text[E.frame.start[old]], len) == 0)
+          continue;
+      } else if (len == 0) {
+        // lines scrolled in are blank
+        continue;
+      }
+    }
+    snprintf(buf, sizeof(buf), "\x1b[%d;1H", y + 1);
+    abAppend(&ab, buf, strlen(buf));
+    abAppend(&ab, line, len);
+    // EraseCurrent Line -[0k => 0 to erase part of line after the cursor
+    abAppend(&ab, "\x1b[K", 3);
+  }
 
   // Cursor Motion
-  char buf[32];
   // E.rowoff & E.coloff sets the cursor offsets that allow to scroll
-  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1,
-           (E.rx - E.coloff) + 1);
+  if (E.wrap) {
+    int col;
+    long long line = editorCursorLine(&col);
+    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (int)(line - E.voff) + 1,
+             col + 1);
+  } else {
+    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1,
+             (E.rx - E.coloff) + 1);
+  }
   abAppend(&ab, buf, strlen(buf));
 
   // Show Cursor
   abAppend(&ab, "\x1b[?25h", 6);
+  abAppend(&ab, "\x1b[?2026l", 8);
 
   write(STDIN_FILENO, ab.b, ab.len);
   abFree(&ab);
+
+  // Keeping the frame to compare the next one with
+  free(E.frame.text);
+  free(E.frame.start);
+  E.frame.text = frame.b;
+  E.frame.start = start;
+  E.frame.numlines = numlines;
+  E.frame.rowoff = top;
 }
 
 // Write Status Message
@@ -1035,25 +4114,80 @@ void initEditor() {
   E.coloff = 0;
   E.numrows = 0;
   E.row = 0;
+  E.offsets.tree = NULL;
+  E.offsets.cap = 0;
+  E.offsets.valid = 0;
+  E.offsets.nshifts = 0;
+  E.wrap = 0;
+  E.vlines.tree = NULL;
+  E.vlines.cap = 0;
+  E.vlines.valid = 0;
+  E.load.fd = -1;
+  E.wrapcols = 0;
+  E.voff = 0;
+  E.wraprowoff = -1;
   E.dirty = 0;
+  E.changes = 0;
+  E.numundo = 0;
+  E.save = NULL;
+  E.markset = 0;
+  E.clip = NULL;
+  E.numclip = 0;
+  E.disk.valid = 0;
+  E.disk.numrows = 0;
+  E.epoch = 1;
+  E.clean = 0;
+  E.shiftrow = INT_MAX;
   E.filename = NULL;
+  E.codec = NULL;
   E.statusmsg[0] = '\0';
   E.statusmsg_time = 0;
+  E.frame.text = NULL;
+  E.frame.start = NULL;
+  E.frame.numlines = 0;
+  E.renderbytes = 0;
+  E.budget = TEXT_RENDER_BUDGET;
+  E.renderkept = 0;
+
+  // a codec exiting early must fail the write, not kill the editor
+  signal(SIGPIPE, SIG_IGN);
 
   if (getWindowSize(&E.screenrows, &E.screencols) == -1)
     die("getWindowSize");
   E.screenrows -= 2;
+
+  // resizes are picked up by editorReadKey
+  if (pipe2(winch_pipe, O_CLOEXEC | O_NONBLOCK) == -1)
+    die("pipe");
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = editorHandleWinch;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGWINCH, &sa, NULL) == -1)
+    die("sigaction");
 }
 
 int main(int argc, char *argv[]) {
+  // 'text -' reads the text from stdin, the keys then come from the tty
+  int input = -1;
+  if (argc >= 2 && strcmp(argv[1], "-") == 0) {
+    input = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 0);
+    int tty = open("/dev/tty", O_RDWR | O_CLOEXEC);
+    if (input == -1 || tty == -1 || dup2(tty, STDIN_FILENO) == -1)
+      die("/dev/tty");
+    close(tty);
+  }
   enableRawMode();
   initEditor();
-  if (argc >= 2) {
+  if (input != -1) {
+    editorLoad(input);
+  } else if (argc >= 2) {
     editorOpen(argv[1]);
   }
 
   editorSetStatusMessage(
-      "HELP : Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
+      "HELP : Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find | Ctrl-R = regex");
 
   while (1) {
     editorRefreshScreen();